@@ -0,0 +1,123 @@
+/* catpion-shm-reader.c
+ * Example reader for the obs-catpion shared memory caption feed.
+ *
+ * Usage: catpion-shm-reader <name>
+ * where <name> is the "Shared memory feed name" set on the caption source.
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "caption-shm-layout.h"
+
+static const char *kind_name(uint32_t kind)
+{
+	switch (kind) {
+	case CATPION_SHM_PARTIAL:
+		return "partial";
+	case CATPION_SHM_FINAL:
+		return "final";
+	case CATPION_SHM_SILENCE:
+		return "silence";
+	}
+	return "?";
+}
+
+/* Copy the latest record, returns 0 if a consistent copy was taken */
+static int read_latest(const struct catpion_shm_header *h, struct catpion_shm_record *out)
+{
+	for (int attempt = 0; attempt < 8; attempt++) {
+		uint64_t write_index = __atomic_load_n(&h->write_index, __ATOMIC_ACQUIRE);
+		if (write_index == 0)
+			return -1;
+
+		const struct catpion_shm_record *rec = &h->records[(write_index - 1) % h->num_records];
+		uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(out, rec, sizeof(*out));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <name>\n", argv[0]);
+		return 1;
+	}
+
+	char path[256];
+	snprintf(path, sizeof(path), "%s%s", CATPION_SHM_PREFIX, argv[1]);
+
+	int fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	const struct catpion_shm_header *h =
+		mmap(NULL, sizeof(struct catpion_shm_header), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (h->magic != CATPION_SHM_MAGIC || h->version != CATPION_SHM_VERSION ||
+	    h->record_size != sizeof(struct catpion_shm_record)) {
+		fprintf(stderr, "%s: unsupported layout\n", path);
+		return 1;
+	}
+
+	static struct catpion_shm_record rec;
+	uint64_t last_index = UINT64_MAX;
+
+	/* Poll at ~60 Hz, no syscalls are needed to read the feed itself */
+	const struct timespec frame = {0, 16666666};
+	for (;;) {
+		nanosleep(&frame, NULL);
+
+		if (read_latest(h, &rec) != 0 || rec.index == last_index)
+			continue;
+		last_index = rec.index;
+
+		printf("#%llu %s\n", (unsigned long long)rec.index, kind_name(rec.kind));
+		for (uint32_t i = 0; i < rec.num_lines && i < CATPION_SHM_LINES_MAX; i++) {
+			printf("  line %u: %.*s\n", i, (int)rec.line_len[i], rec.lines_text + rec.line_offset[i]);
+		}
+		for (uint32_t i = 0; i < rec.num_tokens && i < CATPION_SHM_TOKENS_MAX; i++) {
+			const struct catpion_shm_token *t = &rec.tokens[i];
+			printf("  %6u ms [%.*s]\n", t->time_ms, (int)t->text_len, rec.tokens_text + t->text_offset);
+		}
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,439 @@
+/* caption-fanout.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "caption-fanout.h"
+
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RING_MASK (CAPTION_FANOUT_RING - 1)
+
+enum deliver_result {
+	DELIVER_OK,
+	DELIVER_SKIPPED,
+	DELIVER_RETRY,
+	DELIVER_ERROR,
+};
+
+/* Destinations */
+static bool fanout_dest_open_udp(struct caption_fanout_dest *d, const char *hostport)
+{
+	char host[256];
+	const char *port = strrchr(hostport, ':');
+	if (!port || port == hostport || (size_t)(port - hostport) >= sizeof(host)) {
+		return false;
+	}
+
+	size_t host_len = port - hostport;
+	port++;
+
+	/* [::1]:5050 */
+	if (hostport[0] == '[' && hostport[host_len - 1] == ']') {
+		hostport++;
+		host_len -= 2;
+	}
+	memcpy(host, hostport, host_len);
+	host[host_len] = '\0';
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	struct addrinfo *res = NULL;
+	int err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0 || !res) {
+		blog(LOG_WARNING, "[catpion] Can't resolve %s: %s", d->uri, gai_strerror(err));
+		return false;
+	}
+
+	d->fd = socket(res->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (d->fd >= 0) {
+		memcpy(&d->addr, res->ai_addr, res->ai_addrlen);
+		d->addr_len = res->ai_addrlen;
+	}
+	freeaddrinfo(res);
+
+	return d->fd >= 0;
+}
+
+static bool fanout_dest_open_unix(struct caption_fanout_dest *d, const char *path)
+{
+	struct sockaddr_un *addr = (struct sockaddr_un *)&d->addr;
+	size_t len = strlen(path);
+	if (len == 0 || len >= sizeof(addr->sun_path)) {
+		return false;
+	}
+
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len + 1);
+	d->addr_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+	d->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	return d->fd >= 0;
+}
+
+static bool fanout_dest_open(struct caption_fanout_dest *d, const char *uri, long write_pos)
+{
+	memset(d, 0, sizeof(*d));
+	d->fd = -1;
+	d->uri = bstrdup(uri);
+	d->read_pos = write_pos;
+
+	bool ok = false;
+	if (strncmp(uri, "udp://", 6) == 0) {
+		d->type = CAPTION_FANOUT_UDP;
+		ok = fanout_dest_open_udp(d, uri + 6);
+	} else if (strncmp(uri, "unix://", 7) == 0) {
+		d->type = CAPTION_FANOUT_UNIX;
+		ok = fanout_dest_open_unix(d, uri + 7);
+	} else if (strncmp(uri, "file://", 7) == 0) {
+		d->type = CAPTION_FANOUT_FILE;
+		d->fd = open(uri + 7, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		ok = d->fd >= 0;
+	}
+
+	if (!ok) {
+		blog(LOG_WARNING, "[catpion] Can't open caption destination '%s'", uri);
+		if (d->fd >= 0) {
+			close(d->fd);
+		}
+		bfree(d->uri);
+		return false;
+	}
+
+	blog(LOG_INFO, "[catpion] Caption destination '%s' ready", uri);
+	return true;
+}
+
+static void fanout_dest_close(struct caption_fanout_dest *d)
+{
+	blog(LOG_INFO, "[catpion] Caption destination '%s': sent %ld dropped %ld errors %ld", d->uri,
+	     os_atomic_load_long(&d->sent), os_atomic_load_long(&d->dropped), os_atomic_load_long(&d->errors));
+
+	if (d->fd >= 0) {
+		close(d->fd);
+	}
+	bfree(d->uri);
+}
+
+static enum deliver_result fanout_dest_deliver(struct caption_fanout_dest *d, const struct caption_fanout_record *rec)
+{
+	ssize_t rc;
+
+	if (d->type == CAPTION_FANOUT_FILE) {
+		/* Files get a plain transcript of finished captions */
+		if (!(rec->flags & CAPTION_FANOUT_FINAL) || rec->text_len == 0) {
+			return DELIVER_SKIPPED;
+		}
+		rc = write(d->fd, rec->text, rec->text_len);
+		if (rc >= 0) {
+			rc = write(d->fd, "\n", 1);
+		}
+	} else {
+		if (rec->packet_len == 0) {
+			return DELIVER_SKIPPED;
+		}
+		rc = sendto(d->fd, rec->packet, rec->packet_len, MSG_DONTWAIT | MSG_NOSIGNAL,
+			    (struct sockaddr *)&d->addr, d->addr_len);
+	}
+
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			return DELIVER_RETRY;
+		}
+		return DELIVER_ERROR;
+	}
+	return DELIVER_OK;
+}
+/* ------------------------------------------------- */
+
+/* Ring */
+static bool fanout_read_record(struct caption_fanout *fo, long pos, struct caption_fanout_record *out)
+{
+	const struct caption_fanout_record *rec = &fo->ring[pos & RING_MASK];
+
+	long seq = os_atomic_load_long(&rec->seq);
+	if (seq != 2 * (pos + 1)) {
+		return false;
+	}
+
+	out->flags = rec->flags;
+	out->packet_len = rec->packet_len < CAPTION_FANOUT_PACKET_MAX ? rec->packet_len : CAPTION_FANOUT_PACKET_MAX;
+	out->text_len = rec->text_len < CAPTION_FANOUT_TEXT_MAX ? rec->text_len : CAPTION_FANOUT_TEXT_MAX;
+	memcpy(out->packet, rec->packet, out->packet_len);
+	memcpy(out->text, rec->text, out->text_len);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return os_atomic_load_long(&rec->seq) == seq;
+}
+
+struct caption_fanout_record *caption_fanout_begin(struct caption_fanout *fo)
+{
+	long pos = fo->write_pos;
+	struct caption_fanout_record *rec = &fo->ring[pos & RING_MASK];
+
+	os_atomic_set_long(&rec->seq, 2 * pos + 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->flags = 0;
+	rec->packet_len = 0;
+	rec->text_len = 0;
+	return rec;
+}
+
+void caption_fanout_commit(struct caption_fanout *fo, struct caption_fanout_record *rec, uint32_t packet_len,
+			   uint32_t flags)
+{
+	long pos = fo->write_pos;
+
+	rec->flags = flags;
+	rec->packet_len = packet_len;
+
+	os_atomic_set_long(&rec->seq, 2 * (pos + 1));
+	os_atomic_set_long(&fo->write_pos, pos + 1);
+
+	if (fo->thread_started) {
+		os_event_signal(fo->event);
+	}
+}
+
+/**
+ * Send everything a destination has pending.
+ * @return false if the destination is blocked and needs a retry
+ */
+static bool fanout_dest_flush(struct caption_fanout *fo, struct caption_fanout_dest *d,
+			      struct caption_fanout_record *scratch, long write_pos)
+{
+	while (d->read_pos < write_pos) {
+		/* drop oldest */
+		if (write_pos - d->read_pos > CAPTION_FANOUT_RING) {
+			os_atomic_set_long(&d->dropped, d->dropped + (write_pos - CAPTION_FANOUT_RING - d->read_pos));
+			d->read_pos = write_pos - CAPTION_FANOUT_RING;
+		}
+
+		if (!fanout_read_record(fo, d->read_pos, scratch)) {
+			/* overwritten while reading */
+			os_atomic_inc_long(&d->dropped);
+			d->read_pos++;
+			continue;
+		}
+
+		switch (fanout_dest_deliver(d, scratch)) {
+		case DELIVER_RETRY:
+			return false;
+		case DELIVER_ERROR:
+			os_atomic_inc_long(&d->errors);
+			break;
+		case DELIVER_OK:
+			os_atomic_inc_long(&d->sent);
+			break;
+		case DELIVER_SKIPPED:
+			break;
+		}
+		d->read_pos++;
+	}
+	return true;
+}
+/* ------------------------------------------------- */
+
+/* Sender thread */
+static void fanout_apply_config(struct caption_fanout *fo)
+{
+	pthread_mutex_lock(&fo->config_mutex);
+	char *config = fo->pending_config;
+	fo->pending_config = NULL;
+	os_atomic_set_bool(&fo->config_changed, false);
+	pthread_mutex_unlock(&fo->config_mutex);
+
+	/* Resolve and open outside of the lock, it may block */
+	struct caption_fanout_dest *dests = NULL;
+	size_t num_dests = 0;
+	long write_pos = os_atomic_load_long(&fo->write_pos);
+
+	char *saveptr = NULL;
+	for (char *uri = config ? strtok_r(config, "\r\n", &saveptr) : NULL; uri;
+	     uri = strtok_r(NULL, "\r\n", &saveptr)) {
+		while (*uri == ' ' || *uri == '\t')
+			uri++;
+		if (!*uri)
+			continue;
+
+		dests = brealloc(dests, sizeof(*dests) * (num_dests + 1));
+		if (fanout_dest_open(&dests[num_dests], uri, write_pos)) {
+			num_dests++;
+		}
+	}
+	bfree(config);
+
+	pthread_mutex_lock(&fo->config_mutex);
+	struct caption_fanout_dest *old_dests = fo->dests;
+	size_t old_num_dests = fo->num_dests;
+	fo->dests = dests;
+	fo->num_dests = num_dests;
+	pthread_mutex_unlock(&fo->config_mutex);
+
+	for (size_t i = 0; i < old_num_dests; i++) {
+		fanout_dest_close(&old_dests[i]);
+	}
+	bfree(old_dests);
+}
+
+static void *caption_fanout_thread(void *data)
+{
+	struct caption_fanout *fo = data;
+	struct caption_fanout_record *scratch = bmalloc(sizeof(struct caption_fanout_record));
+	bool retry = false;
+
+	os_set_thread_name("catpion-fanout");
+
+	while (os_atomic_load_bool(&fo->running)) {
+		if (retry) {
+			os_event_timedwait(fo->event, 10);
+		} else {
+			os_event_wait(fo->event);
+		}
+
+		if (os_atomic_load_bool(&fo->config_changed)) {
+			fanout_apply_config(fo);
+		}
+
+		long write_pos = os_atomic_load_long(&fo->write_pos);
+
+		retry = false;
+		for (size_t i = 0; i < fo->num_dests; i++) {
+			if (!fanout_dest_flush(fo, &fo->dests[i], scratch, write_pos)) {
+				retry = true;
+			}
+		}
+	}
+
+	bfree(scratch);
+	return NULL;
+}
+/* ------------------------------------------------- */
+
+void caption_fanout_init(struct caption_fanout *fo)
+{
+	memset(fo, 0, sizeof(*fo));
+	pthread_mutex_init(&fo->config_mutex, NULL);
+	os_event_init(&fo->event, OS_EVENT_TYPE_AUTO);
+}
+
+static void fanout_stop_thread(struct caption_fanout *fo)
+{
+	if (fo->thread_started) {
+		os_atomic_set_bool(&fo->running, false);
+		os_event_signal(fo->event);
+		pthread_join(fo->thread, NULL);
+		fo->thread_started = false;
+	}
+}
+
+void caption_fanout_destroy(struct caption_fanout *fo)
+{
+	fanout_stop_thread(fo);
+
+	for (size_t i = 0; i < fo->num_dests; i++) {
+		fanout_dest_close(&fo->dests[i]);
+	}
+	bfree(fo->dests);
+	bfree(fo->config);
+	bfree(fo->pending_config);
+	bfree(fo->ring);
+
+	os_event_destroy(fo->event);
+	pthread_mutex_destroy(&fo->config_mutex);
+}
+
+bool caption_fanout_set_destinations(struct caption_fanout *fo, const char *uris)
+{
+	if (!uris)
+		uris = "";
+	if (fo->config && strcmp(fo->config, uris) == 0) {
+		return fo->has_dests;
+	}
+	bfree(fo->config);
+	fo->config = bstrdup(uris);
+	fo->has_dests = false;
+
+	bool any = false;
+	for (const char *p = uris; p && *p; p++) {
+		if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+			any = true;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&fo->config_mutex);
+	bfree(fo->pending_config);
+	fo->pending_config = bstrdup(uris);
+	os_atomic_set_bool(&fo->config_changed, true);
+	pthread_mutex_unlock(&fo->config_mutex);
+
+	if (any && !fo->thread_started) {
+		if (!fo->ring) {
+			fo->ring = bzalloc(sizeof(struct caption_fanout_record) * CAPTION_FANOUT_RING);
+		}
+		fo->running = true;
+		if (pthread_create(&fo->thread, NULL, caption_fanout_thread, fo) == 0) {
+			fo->thread_started = true;
+		} else {
+			blog(LOG_ERROR, "[catpion] Can't start caption sender thread");
+			return false;
+		}
+	}
+
+	if (!any) {
+		/* nothing left to send to, the thread and ring are not kept around */
+		fanout_stop_thread(fo);
+		fanout_apply_config(fo);
+		bfree(fo->ring);
+		fo->ring = NULL;
+		return false;
+	}
+
+	os_event_signal(fo->event);
+	fo->has_dests = true;
+	return true;
+}
+
+void caption_fanout_get_stats(struct caption_fanout *fo, struct caption_fanout_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&fo->config_mutex);
+	stats->num_dests = fo->num_dests;
+	for (size_t i = 0; i < fo->num_dests; i++) {
+		stats->sent += os_atomic_load_long(&fo->dests[i].sent);
+		stats->dropped += os_atomic_load_long(&fo->dests[i].dropped);
+		stats->errors += os_atomic_load_long(&fo->dests[i].errors);
+	}
+	pthread_mutex_unlock(&fo->config_mutex);
+}
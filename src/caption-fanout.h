@@ -0,0 +1,139 @@
+/* caption-fanout.h
+ * Delivers caption packets produced on the ASR thread to a set of
+ * destinations from a dedicated sender thread.
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <util/threading.h>
+
+/* Must be a power of two */
+#define CAPTION_FANOUT_RING 16
+#define CAPTION_FANOUT_PACKET_MAX 8192
+#define CAPTION_FANOUT_TEXT_MAX 4096
+
+/* The record closes a caption (final result or a finished line) */
+#define CAPTION_FANOUT_FINAL (1 << 0)
+
+/**
+ * One slot of the broadcast ring. seq is odd while the producer writes it
+ * and 2 * (position + 1) once the record for that position is complete.
+ */
+struct caption_fanout_record {
+	volatile long seq;
+
+	uint32_t flags;
+	uint32_t packet_len;
+	uint32_t text_len;
+
+	char packet[CAPTION_FANOUT_PACKET_MAX];
+	char text[CAPTION_FANOUT_TEXT_MAX];
+};
+
+enum caption_fanout_dest_type {
+	CAPTION_FANOUT_UDP,
+	CAPTION_FANOUT_UNIX,
+	CAPTION_FANOUT_FILE,
+};
+
+/**
+ * A destination with its own read cursor into the ring. When a destination
+ * falls more than CAPTION_FANOUT_RING records behind the oldest records are
+ * dropped.
+ */
+struct caption_fanout_dest {
+	enum caption_fanout_dest_type type;
+	char *uri;
+	int fd;
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	long read_pos;
+
+	volatile long sent;
+	volatile long dropped;
+	volatile long errors;
+};
+
+struct caption_fanout_stats {
+	size_t num_dests;
+	long sent;
+	long dropped;
+	long errors;
+};
+
+/**
+ * Single producer (the ASR result thread), single sender thread.
+ * The producer never blocks and never does any I/O.
+ */
+struct caption_fanout {
+	struct caption_fanout_record *ring;
+	volatile long write_pos;
+
+	/* owned by the sender thread, guarded by config_mutex for readers */
+	struct caption_fanout_dest *dests;
+	size_t num_dests;
+
+	/* new destination list, applied by the sender thread */
+	pthread_mutex_t config_mutex;
+	char *config;
+	bool has_dests;
+	char *pending_config;
+	volatile bool config_changed;
+
+	os_event_t *event;
+	pthread_t thread;
+	volatile bool running;
+	bool thread_started;
+};
+
+void caption_fanout_init(struct caption_fanout *fo);
+void caption_fanout_destroy(struct caption_fanout *fo);
+
+/**
+ * Replace the destination list. One URI per line:
+ * udp://host:port, unix:///path/to/socket or file:///path/to/file
+ * An empty list stops the sender thread and frees the ring, nothing may be
+ * produced until a list with destinations is set again.
+ * @return true if the list has at least one destination
+ */
+bool caption_fanout_set_destinations(struct caption_fanout *fo, const char *uris);
+
+/**
+ * Claim the next ring slot for writing, overwriting the oldest record.
+ * Must be followed by caption_fanout_commit.
+ */
+struct caption_fanout_record *caption_fanout_begin(struct caption_fanout *fo);
+
+/**
+ * Publish a record claimed with caption_fanout_begin. The caller fills
+ * packet/text and text_len, the plain text is what file destinations write.
+ */
+void caption_fanout_commit(struct caption_fanout *fo, struct caption_fanout_record *rec, uint32_t packet_len,
+			   uint32_t flags);
+
+void caption_fanout_get_stats(struct caption_fanout *fo, struct caption_fanout_stats *stats);
@@ -0,0 +1,411 @@
+/* caption-outputs.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "caption-outputs.h"
+
+#include <obs-module.h>
+#include <obs-frontend-api.h>
+#include <util/platform.h>
+
+#include <string.h>
+
+/* Words kept around to fill the rows, enough to wrap CEA608_ROWS rows */
+#define CAPTION_OUTPUTS_WINDOW_MAX (CEA608_COLUMNS * CEA608_ROWS * 2)
+
+struct caption_row {
+	const char *text;
+	size_t len;
+};
+
+static void add_row(struct caption_row *rows, size_t *count, const char *text, size_t len)
+{
+	rows[*count % CEA608_ROWS].text = text;
+	rows[*count % CEA608_ROWS].len = len;
+	(*count)++;
+}
+
+/* Wrap the window at word boundaries and keep its last CEA608_ROWS rows */
+static void format_rows(const char *text, struct dstr *out)
+{
+	struct caption_row rows[CEA608_ROWS];
+	size_t count = 0;
+	const char *row = NULL;
+	size_t row_len = 0;
+
+	for (const char *p = text; *p;) {
+		if (*p == ' ') {
+			p++;
+			continue;
+		}
+		const char *word = p;
+		while (*p && *p != ' ')
+			p++;
+		size_t word_len = p - word;
+
+		while (word_len > CEA608_COLUMNS) {
+			if (row_len)
+				add_row(rows, &count, row, row_len);
+			add_row(rows, &count, word, CEA608_COLUMNS);
+			row_len = 0;
+			word += CEA608_COLUMNS;
+			word_len -= CEA608_COLUMNS;
+		}
+
+		if (row_len && (size_t)(word + word_len - row) <= CEA608_COLUMNS) {
+			row_len = word + word_len - row;
+		} else {
+			if (row_len)
+				add_row(rows, &count, row, row_len);
+			row = word;
+			row_len = word_len;
+		}
+	}
+	if (row_len)
+		add_row(rows, &count, row, row_len);
+
+	dstr_resize(out, 0);
+	size_t first = count > CEA608_ROWS ? count - CEA608_ROWS : 0;
+	for (size_t i = first; i < count; i++) {
+		if (i != first)
+			dstr_cat_ch(out, '\n');
+		dstr_ncat(out, rows[i % CEA608_ROWS].text, rows[i % CEA608_ROWS].len);
+	}
+}
+
+/* Named outputs that don't exist yet are looked up again this often */
+#define CAPTION_OUTPUTS_LOOKUP_NS 2000000000ULL
+#define CAPTION_OUTPUTS_MAX 32
+
+static obs_output_t *frontend_output(uint32_t frontend)
+{
+	switch (frontend) {
+	case CAPTION_OUTPUT_STREAM:
+		return obs_frontend_get_streaming_output();
+	case CAPTION_OUTPUT_RECORDING:
+		return obs_frontend_get_recording_output();
+	case CAPTION_OUTPUT_REPLAY_BUFFER:
+		return obs_frontend_get_replay_buffer_output();
+	}
+	return NULL;
+}
+
+static void target_set_output(struct caption_output_target *t, obs_output_t *output)
+{
+	obs_weak_output_release(t->output);
+	t->output = output ? obs_output_get_weak_output(output) : NULL;
+	obs_output_release(output);
+}
+
+/* Take references to the outputs that are running, called with the mutex held */
+static size_t get_active_outputs(struct caption_outputs *co, uint64_t now, obs_output_t **outputs,
+				 struct caption_output_target **targets)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < co->num_targets && count < CAPTION_OUTPUTS_MAX; i++) {
+		struct caption_output_target *t = &co->targets[i];
+
+		if (!t->output && t->name && now >= t->next_lookup_ns) {
+			target_set_output(t, obs_get_output_by_name(t->name));
+			t->next_lookup_ns = now + CAPTION_OUTPUTS_LOOKUP_NS;
+		}
+
+		obs_output_t *output = t->output ? obs_weak_output_get_output(t->output) : NULL;
+		if (!output) {
+			/* the output went away, named ones get looked up again */
+			if (t->output && t->name)
+				target_set_output(t, NULL);
+			continue;
+		}
+		if (!obs_output_active(output)) {
+			obs_output_release(output);
+			continue;
+		}
+		outputs[count] = output;
+		targets[count] = t;
+		count++;
+	}
+	return count;
+}
+
+static void *caption_outputs_thread(void *data)
+{
+	struct caption_outputs *co = data;
+	struct dstr text = {0};
+	uint64_t next_send_ns = 0;
+	obs_output_t *outputs[CAPTION_OUTPUTS_MAX];
+	struct caption_output_target *targets[CAPTION_OUTPUTS_MAX];
+
+	os_set_thread_name("catpion-captions");
+
+	while (os_atomic_load_bool(&co->running)) {
+		uint64_t now = os_gettime_ns();
+		if (now < next_send_ns) {
+			os_event_timedwait(co->event, (unsigned long)((next_send_ns - now) / 1000000) + 1);
+			continue;
+		}
+
+		pthread_mutex_lock(&co->mutex);
+		if (!co->dirty) {
+			pthread_mutex_unlock(&co->mutex);
+			os_event_wait(co->event);
+			continue;
+		}
+		co->dirty = false;
+		format_rows(co->window.array, &text);
+		size_t count = dstr_is_empty(&text) ? 0 : get_active_outputs(co, now, outputs, targets);
+		for (size_t i = 0; i < count; i++)
+			targets[i]->captions++;
+		pthread_mutex_unlock(&co->mutex);
+
+		if (!count)
+			continue;
+
+		/* The caption stays up until the channel had time to carry it,
+		 * which is also when the next one may go out */
+		double duration = (double)(text.len + CEA608_CAPTION_OVERHEAD) / CEA608_BYTES_PER_SEC;
+		for (size_t i = 0; i < count; i++) {
+			obs_output_output_caption_text2(outputs[i], text.array, duration);
+			obs_output_release(outputs[i]);
+		}
+
+		next_send_ns = now + (uint64_t)(duration * 1000000000.0);
+	}
+
+	dstr_free(&text);
+	return NULL;
+}
+
+/* Frontend calls are only safe from the UI thread, which looks the outputs
+ * up for every registered caption_outputs */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct caption_outputs *registry = NULL;
+
+static void caption_outputs_refresh(struct caption_outputs *co, uint32_t frontend)
+{
+	pthread_mutex_lock(&co->mutex);
+	for (size_t i = 0; i < co->num_targets; i++) {
+		struct caption_output_target *t = &co->targets[i];
+		if (t->frontend & frontend)
+			target_set_output(t, frontend_output(t->frontend));
+	}
+	pthread_mutex_unlock(&co->mutex);
+}
+
+static void caption_outputs_refresh_all(uint32_t frontend)
+{
+	pthread_mutex_lock(&registry_mutex);
+	for (struct caption_outputs *co = registry; co; co = co->next)
+		caption_outputs_refresh(co, frontend);
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+static void caption_outputs_refresh_task(void *param)
+{
+	caption_outputs_refresh_all((uint32_t)(uintptr_t)param);
+}
+
+static void caption_outputs_frontend_cb(enum obs_frontend_event event, void *data)
+{
+	UNUSED_PARAMETER(data);
+
+	/* The frontend may recreate its outputs when their settings change */
+	switch (event) {
+	case OBS_FRONTEND_EVENT_STREAMING_STARTED:
+		caption_outputs_refresh_all(CAPTION_OUTPUT_STREAM);
+		break;
+	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
+		caption_outputs_refresh_all(CAPTION_OUTPUT_RECORDING);
+		break;
+	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STARTED:
+		caption_outputs_refresh_all(CAPTION_OUTPUT_REPLAY_BUFFER);
+		break;
+	default:
+		break;
+	}
+}
+
+void caption_outputs_module_load(void)
+{
+	obs_frontend_add_event_callback(caption_outputs_frontend_cb, NULL);
+}
+
+void caption_outputs_module_unload(void)
+{
+	obs_frontend_remove_event_callback(caption_outputs_frontend_cb, NULL);
+}
+
+static void caption_outputs_clear_targets(struct caption_output_target *targets, size_t num_targets)
+{
+	for (size_t i = 0; i < num_targets; i++) {
+		struct caption_output_target *t = &targets[i];
+		if (t->captions) {
+			blog(LOG_INFO, "[catpion] %ld captions sent to %s", t->captions,
+			     t->name ? t->name
+				     : (t->frontend == CAPTION_OUTPUT_STREAM      ? "the stream"
+					: t->frontend == CAPTION_OUTPUT_RECORDING ? "the recording"
+										  : "the replay buffer"));
+		}
+		obs_weak_output_release(t->output);
+		bfree(t->name);
+	}
+	bfree(targets);
+}
+
+void caption_outputs_init(struct caption_outputs *co)
+{
+	memset(co, 0, sizeof(*co));
+	pthread_mutex_init(&co->mutex, NULL);
+	os_event_init(&co->event, OS_EVENT_TYPE_AUTO);
+
+	pthread_mutex_lock(&registry_mutex);
+	co->next = registry;
+	registry = co;
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+void caption_outputs_destroy(struct caption_outputs *co)
+{
+	/* a refresh task still queued finds nothing of this one */
+	pthread_mutex_lock(&registry_mutex);
+	for (struct caption_outputs **p = &registry; *p; p = &(*p)->next) {
+		if (*p == co) {
+			*p = co->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	caption_outputs_set_targets(co, 0, NULL);
+
+	if (co->thread_started) {
+		os_atomic_set_bool(&co->running, false);
+		os_event_signal(co->event);
+		pthread_join(co->thread, NULL);
+		co->thread_started = false;
+
+		if (co->superseded)
+			blog(LOG_INFO, "[catpion] %ld captions superseded before they could be sent", co->superseded);
+	}
+
+	bfree(co->names);
+	dstr_free(&co->sent);
+	dstr_free(&co->window);
+	os_event_destroy(co->event);
+	pthread_mutex_destroy(&co->mutex);
+}
+
+bool caption_outputs_set_targets(struct caption_outputs *co, uint32_t frontend, const char *names)
+{
+	if (!names)
+		names = "";
+	if (frontend == co->frontend && co->names && strcmp(names, co->names) == 0)
+		return co->num_targets > 0;
+
+	bfree(co->names);
+	co->names = bstrdup(names);
+	co->frontend = frontend;
+
+	struct caption_output_target *targets = bzalloc(sizeof(struct caption_output_target) * CAPTION_OUTPUTS_MAX);
+	size_t num_targets = 0;
+
+	/* the outputs themselves are filled in by the refresh task */
+	for (uint32_t f = CAPTION_OUTPUT_STREAM; f <= CAPTION_OUTPUT_REPLAY_BUFFER; f <<= 1) {
+		if (frontend & f)
+			targets[num_targets++].frontend = f;
+	}
+
+	for (const char *p = names; *p && num_targets < CAPTION_OUTPUTS_MAX;) {
+		size_t len = strcspn(p, "\r\n");
+		const char *end = p + len;
+		while (len && (*p == ' ' || *p == '\t')) {
+			p++;
+			len--;
+		}
+		while (len && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+			len--;
+		if (len)
+			targets[num_targets++].name = bstrdup_n(p, len);
+		p = end + strspn(end, "\r\n");
+	}
+
+	pthread_mutex_lock(&co->mutex);
+	struct caption_output_target *old = co->targets;
+	size_t old_num = co->num_targets;
+	co->targets = targets;
+	co->num_targets = num_targets;
+	pthread_mutex_unlock(&co->mutex);
+
+	caption_outputs_clear_targets(old, old_num);
+
+	if (frontend)
+		obs_queue_task(OBS_TASK_UI, caption_outputs_refresh_task, (void *)(uintptr_t)frontend, false);
+
+	if (num_targets && !co->thread_started) {
+		co->running = true;
+		if (pthread_create(&co->thread, NULL, caption_outputs_thread, co) == 0) {
+			co->thread_started = true;
+		} else {
+			blog(LOG_ERROR, "[catpion] Can't start caption output thread");
+		}
+	}
+
+	return num_targets > 0;
+}
+
+void caption_outputs_push(struct caption_outputs *co, const char *text, size_t len, bool final)
+{
+	pthread_mutex_lock(&co->mutex);
+
+	/* Words already sent can't be taken back, if the recognizer revised
+	 * them send again from the start of the revised word */
+	size_t common = 0;
+	while (common < co->sent.len && common < len && co->sent.array[common] == text[common])
+		common++;
+	if (common < co->sent.len) {
+		while (common > 0 && text[common - 1] != ' ')
+			common--;
+	}
+
+	if (common < len) {
+		if (!dstr_is_empty(&co->window) && co->window.array[co->window.len - 1] != ' ' && text[common] != ' ')
+			dstr_cat_ch(&co->window, ' ');
+		dstr_ncat(&co->window, text + common, len - common);
+
+		if (co->window.len > CAPTION_OUTPUTS_WINDOW_MAX) {
+			const char *cut = co->window.array + co->window.len - CAPTION_OUTPUTS_WINDOW_MAX;
+			const char *space = strchr(cut, ' ');
+			size_t drop = (space ? space : cut) - co->window.array;
+			memmove(co->window.array, co->window.array + drop, co->window.len - drop + 1);
+			co->window.len -= drop;
+		}
+
+		if (co->dirty)
+			co->superseded++;
+		co->dirty = true;
+		os_event_signal(co->event);
+	}
+
+	if (final)
+		dstr_resize(&co->sent, 0);
+	else
+		dstr_ncopy(&co->sent, text, len);
+
+	pthread_mutex_unlock(&co->mutex);
+}
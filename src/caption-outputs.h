@@ -0,0 +1,109 @@
+/* caption-outputs.h
+ * Paced CEA-608 caption output to the stream, recordings and other outputs
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <obs.h>
+#include <util/dstr.h>
+#include <util/threading.h>
+
+#define CEA608_COLUMNS 32
+#define CEA608_ROWS 2
+/* Line 21 carries 2 bytes per frame at 29.97 fps */
+#define CEA608_BYTES_PER_SEC 60
+/* Control codes that go with every caption: RCL, a PAC per row, EDM and
+ * EOC, all of them sent twice */
+#define CEA608_CAPTION_OVERHEAD 16
+
+/* Outputs owned by the frontend */
+#define CAPTION_OUTPUT_STREAM (1 << 0)
+#define CAPTION_OUTPUT_RECORDING (1 << 1)
+#define CAPTION_OUTPUT_REPLAY_BUFFER (1 << 2)
+
+/**
+ * A frontend output, or one looked up by name (e.g. created by a
+ * multistream plugin) until it shows up.
+ */
+struct caption_output_target {
+	uint32_t frontend;
+	char *name;
+	obs_weak_output_t *output;
+	uint64_t next_lookup_ns;
+	long captions;
+};
+
+/**
+ * Words are rolled into a window of the last CEA608_ROWS rows as they
+ * become stable. A sender thread formats the window once and sends it to
+ * every active target, at most as fast as the 608 channel can carry it.
+ * Windows that were replaced before they could be sent are dropped.
+ */
+struct caption_outputs {
+	pthread_mutex_t mutex;
+
+	/* guarded by mutex */
+	struct caption_output_target *targets;
+	size_t num_targets;
+	struct dstr sent;
+	struct dstr window;
+	bool dirty;
+	long superseded;
+
+	uint32_t frontend;
+	char *names;
+
+	/* every caption_outputs, for the frontend callback */
+	struct caption_outputs *next;
+
+	os_event_t *event;
+	pthread_t thread;
+	volatile bool running;
+	bool thread_started;
+};
+
+/**
+ * Follow the frontend recreating its outputs for every caption_outputs.
+ * @warning Call from the UI thread, in module load and unload
+ */
+void caption_outputs_module_load(void);
+void caption_outputs_module_unload(void);
+
+void caption_outputs_init(struct caption_outputs *co);
+void caption_outputs_destroy(struct caption_outputs *co);
+
+/**
+ * Route captions to the frontend outputs in the CAPTION_OUTPUT_* mask and
+ * to the outputs named in names, one per line. Any thread may call it, the
+ * frontend outputs are looked up in a task on the UI thread.
+ * @return true if there is any target
+ */
+bool caption_outputs_set_targets(struct caption_outputs *co, uint32_t frontend, const char *names);
+
+/**
+ * Text of the current utterance that won't change anymore. Only what was
+ * added since the previous call is sent, final ends the utterance.
+ */
+void caption_outputs_push(struct caption_outputs *co, const char *text, size_t len, bool final);
@@ -0,0 +1,91 @@
+/* caption-shm-layout.h
+ * Layout of the shared memory caption feed. This header has no OBS
+ * dependencies so it can be used by external readers as is.
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The segment is named CATPION_SHM_PREFIX + the name set on the source */
+#define CATPION_SHM_PREFIX "/obs-catpion."
+
+#define CATPION_SHM_MAGIC 0x4e505443u /* "CTPN" */
+#define CATPION_SHM_VERSION 1
+
+#define CATPION_SHM_RECORDS 8
+#define CATPION_SHM_LINES_MAX 8
+#define CATPION_SHM_TOKENS_MAX 256
+#define CATPION_SHM_TEXT_MAX 4096
+
+enum catpion_shm_kind {
+	CATPION_SHM_PARTIAL = 1,
+	CATPION_SHM_FINAL = 2,
+	CATPION_SHM_SILENCE = 3,
+};
+
+struct catpion_shm_token {
+	uint32_t text_offset; /* into tokens_text */
+	uint32_t text_len;
+	uint32_t time_ms;
+	uint32_t flags; /* AprilTokenFlagBits */
+	float logprob;
+	uint32_t reserved;
+};
+
+/**
+ * A caption record. seq is a seqlock: it is odd while the record is being
+ * written. Readers copy (or use in place) what they need and accept the
+ * data only if seq is even and unchanged afterwards.
+ */
+struct catpion_shm_record {
+	uint64_t seq;
+	uint64_t index; /* record number, increases by one per record */
+	uint64_t timestamp_ns; /* CLOCK_REALTIME */
+
+	uint32_t kind; /* enum catpion_shm_kind */
+	uint32_t num_lines; /* visible lines, oldest first */
+	uint32_t num_tokens; /* tokens of the current result */
+	uint32_t reserved;
+
+	uint32_t line_offset[CATPION_SHM_LINES_MAX]; /* into lines_text */
+	uint32_t line_len[CATPION_SHM_LINES_MAX];
+
+	struct catpion_shm_token tokens[CATPION_SHM_TOKENS_MAX];
+
+	char lines_text[CATPION_SHM_TEXT_MAX];
+	char tokens_text[CATPION_SHM_TEXT_MAX];
+};
+
+/**
+ * Start of the shared memory segment. write_index is the number of records
+ * published so far, the latest one is records[(write_index - 1) % num_records].
+ */
+struct catpion_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t num_records;
+
+	uint64_t write_index;
+	uint64_t reserved[6];
+
+	struct catpion_shm_record records[CATPION_SHM_RECORDS];
+};
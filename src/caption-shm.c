@@ -0,0 +1,190 @@
+/* caption-shm.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "caption-shm.h"
+
+#include <obs-module.h>
+#include <util/dstr.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void caption_shm_close(struct caption_shm *shm)
+{
+	pthread_mutex_lock(&shm->mutex);
+	struct catpion_shm_header *h = shm->map;
+	shm->map = NULL;
+	pthread_mutex_unlock(&shm->mutex);
+
+	if (h) {
+		munmap(h, sizeof(struct catpion_shm_header));
+	}
+	if (shm->name) {
+		shm_unlink(shm->name);
+		blog(LOG_INFO, "[catpion] Closed shared memory caption feed %s", shm->name);
+		bfree(shm->name);
+		shm->name = NULL;
+	}
+}
+
+void caption_shm_init(struct caption_shm *shm)
+{
+	memset(shm, 0, sizeof(*shm));
+	pthread_mutex_init(&shm->mutex, NULL);
+}
+
+void caption_shm_destroy(struct caption_shm *shm)
+{
+	caption_shm_close(shm);
+	pthread_mutex_destroy(&shm->mutex);
+}
+
+bool caption_shm_set_name(struct caption_shm *shm, const char *name)
+{
+	struct dstr full = {0};
+	if (name && *name) {
+		dstr_copy(&full, CATPION_SHM_PREFIX);
+		for (const char *p = name; *p; p++) {
+			char c = *p;
+			bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+				     c == '-' || c == '_' || c == '.';
+			dstr_cat_ch(&full, valid ? c : '_');
+		}
+	}
+
+	if (shm->name && full.array && strcmp(shm->name, full.array) == 0) {
+		dstr_free(&full);
+		return shm->map != NULL;
+	}
+
+	caption_shm_close(shm);
+	if (!full.array) {
+		return false;
+	}
+
+	int fd = shm_open(full.array, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		blog(LOG_WARNING, "[catpion] Can't create shared memory %s", full.array);
+		dstr_free(&full);
+		return false;
+	}
+
+	struct catpion_shm_header *h = MAP_FAILED;
+	if (ftruncate(fd, sizeof(struct catpion_shm_header)) == 0) {
+		h = mmap(NULL, sizeof(struct catpion_shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+
+	if (h == MAP_FAILED) {
+		blog(LOG_WARNING, "[catpion] Can't map shared memory %s", full.array);
+		shm_unlink(full.array);
+		dstr_free(&full);
+		return false;
+	}
+
+	/* Keep the record numbering if a reader is still attached to an old segment */
+	if (h->magic != CATPION_SHM_MAGIC || h->version != CATPION_SHM_VERSION) {
+		memset(h, 0, sizeof(*h));
+		h->version = CATPION_SHM_VERSION;
+		h->record_size = sizeof(struct catpion_shm_record);
+		h->num_records = CATPION_SHM_RECORDS;
+		__atomic_store_n(&h->magic, CATPION_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	shm->name = bstrdup(full.array);
+	dstr_free(&full);
+
+	pthread_mutex_lock(&shm->mutex);
+	shm->map = h;
+	pthread_mutex_unlock(&shm->mutex);
+
+	blog(LOG_INFO, "[catpion] Publishing captions to shared memory %s", shm->name);
+	return true;
+}
+
+static uint32_t append_text(char *dst, uint32_t *used, const char *src, size_t len)
+{
+	if (*used + len >= CATPION_SHM_TEXT_MAX) {
+		len = CATPION_SHM_TEXT_MAX - 1 - *used;
+	}
+	memcpy(dst + *used, src, len);
+	*used += len;
+	dst[*used] = '\0';
+	return (uint32_t)len;
+}
+
+void caption_shm_publish(struct caption_shm *shm, enum catpion_shm_kind kind, const struct text_view *lines,
+			 size_t num_lines, size_t num_tokens, const AprilToken *tokens)
+{
+	if (pthread_mutex_trylock(&shm->mutex) != 0) {
+		return;
+	}
+
+	struct catpion_shm_header *h = shm->map;
+	if (!h) {
+		pthread_mutex_unlock(&shm->mutex);
+		return;
+	}
+
+	uint64_t index = h->write_index;
+	struct catpion_shm_record *rec = &h->records[index % CATPION_SHM_RECORDS];
+
+	uint64_t seq = rec->seq | 1;
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	rec->index = index;
+	rec->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->kind = kind;
+
+	uint32_t used = 0;
+	if (num_lines > CATPION_SHM_LINES_MAX)
+		num_lines = CATPION_SHM_LINES_MAX;
+	for (size_t i = 0; i < num_lines; i++) {
+		rec->line_offset[i] = used;
+		rec->line_len[i] = append_text(rec->lines_text, &used, lines[i].text, lines[i].len);
+	}
+	rec->num_lines = num_lines;
+
+	used = 0;
+	if (num_tokens > CATPION_SHM_TOKENS_MAX)
+		num_tokens = CATPION_SHM_TOKENS_MAX;
+	for (size_t i = 0; i < num_tokens; i++) {
+		struct catpion_shm_token *t = &rec->tokens[i];
+		t->text_offset = used;
+		t->text_len = append_text(rec->tokens_text, &used, tokens[i].token, strlen(tokens[i].token));
+		t->time_ms = (uint32_t)tokens[i].time_ms;
+		t->flags = tokens[i].flags;
+		t->logprob = tokens[i].logprob;
+	}
+	rec->num_tokens = num_tokens;
+
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->write_index, index + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&shm->mutex);
+}
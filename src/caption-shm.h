@@ -0,0 +1,49 @@
+/* caption-shm.h
+ * Writer side of the shared memory caption feed
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <april_api.h>
+
+#include "caption-shm-layout.h"
+#include "text-snapshot.h"
+
+struct caption_shm {
+	/* publish only trylocks, so the ASR thread never waits on it */
+	pthread_mutex_t mutex;
+	struct catpion_shm_header *map;
+	char *name;
+};
+
+void caption_shm_init(struct caption_shm *shm);
+void caption_shm_destroy(struct caption_shm *shm);
+
+/**
+ * Create (or reuse) the named segment, an empty name closes it.
+ * @return true if the feed is active
+ */
+bool caption_shm_set_name(struct caption_shm *shm, const char *name);
+
+void caption_shm_publish(struct caption_shm *shm, enum catpion_shm_kind kind, const struct text_view *lines,
+			 size_t num_lines, size_t num_tokens, const AprilToken *tokens);
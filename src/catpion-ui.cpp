@@ -4,10 +4,12 @@
 
 #include <util/util.hpp>
 
+#include <QCheckBox>
 #include <QMainWindow>
 #include <QObject>
 #include <QTimer>
 #include <QFileDialog>
+#include <QSignalBlocker>
 
 #include "catpion-ui.hpp"
 #include "model.h"
@@ -27,6 +29,8 @@ CatpionUI::CatpionUI(QWidget *parent)
 			 &CatpionUI::modelLoadButton);
 	QObject::connect(ui->modelUnload, &QPushButton::clicked, this,
 			 &CatpionUI::modelUnloadButton);
+	QObject::connect(ui->modelPrewarm, &QCheckBox::toggled, this,
+			 [this]() { saveSettings(modelPath.c_str()); });
 	QObject::connect(ui->buttonBox->button(QDialogButtonBox::Close),
 			 &QPushButton::clicked, this, &CatpionUI::hide);
 
@@ -40,6 +44,12 @@ void CatpionUI::loadSettings()
 	BPtr<char> jsonData = os_quick_read_utf8_file(path);
 	if (!!jsonData) {
 		obs_data_t *data = obs_data_create_from_json(jsonData);
+		obs_data_set_default_bool(data, "prewarm", true);
+
+		{
+			QSignalBlocker block(ui->modelPrewarm);
+			ui->modelPrewarm->setChecked(obs_data_get_bool(data, "prewarm"));
+		}
 
 		{
 			const char *model_path = obs_data_get_string(data, "model_path");
@@ -54,6 +64,7 @@ void CatpionUI::saveSettings(const char *model_path)
 {
 	obs_data_t *settings = obs_data_create();
 	obs_data_set_string(settings, "model_path", model_path);
+	obs_data_set_bool(settings, "prewarm", ui->modelPrewarm->isChecked());
 
 	BPtr<char> modulePath =
 		obs_module_get_config_path(obs_current_module(), "");
@@ -70,7 +81,7 @@ void CatpionUI::saveSettings(const char *model_path)
 static bool push_model_reload(void *data, obs_source_t *source)
 {
 	const char *name = obs_source_get_id(source);
-	if(strcmp(name, "catpion_audio_input") == 0) {
+	if(strcmp(name, "catpion_audio_input") == 0 || strcmp(name, "catpion_audio_output") == 0) {
 		obs_source_update(source, NULL);
 	}
 	return true;
@@ -111,15 +122,62 @@ void CatpionUI::modelLoadButton()
 
 bool CatpionUI::modelLoad(const char * path)
 {
-	ModelNew(path);
-	if(this->cur_model == ModelCurID()) {
+	if (prewarming) {
+		blog(LOG_WARNING, "[catpion] Still prewarming a model, not loading %s", path);
+		return false;
+	}
+
+	size_t id = ModelNew(path);
+	if(id == MAX_MODELS) {
 	    blog(LOG_ERROR, "Fail loading model: %s", path);
 		return false;
 	}
-	
+	ModelTake(id);
+
+	if (!ui->modelPrewarm->isChecked()) {
+		modelReady(id, path, 0);
+		return true;
+	}
+
+	// Sources keep the current model until this one is warm
+	prewarming = true;
+	ui->modelLoad->setEnabled(false);
+	ui->modelUnload->setEnabled(false);
+	ui->modelPrewarmTime->setText(QT_UTF8(obs_module_text("Catpion.Model.Prewarm.Running")));
+
+	struct prewarm_done {
+		size_t id;
+		uint64_t elapsed_ns;
+		char *path;
+	};
+	auto done = [](size_t id, uint64_t elapsed_ns, void *data) {
+		struct prewarm_done *pd = (struct prewarm_done *)data;
+		pd->elapsed_ns = elapsed_ns;
+		auto ready = [](void *param) {
+			struct prewarm_done *pd = (struct prewarm_done *)param;
+			cui->modelReady(pd->id, pd->path, pd->elapsed_ns);
+			bfree(pd->path);
+			bfree(pd);
+		};
+		obs_queue_task(OBS_TASK_UI, ready, pd, false);
+	};
+	struct prewarm_done *pd = (struct prewarm_done *)bzalloc(sizeof(struct prewarm_done));
+	pd->id = id;
+	pd->path = bstrdup(path);
+	ModelPrewarm(id, done, pd);
+	return true;
+}
+
+void CatpionUI::modelReady(size_t id, const char *path, uint64_t prewarm_ns)
+{
+	prewarming = false;
+	ui->modelLoad->setEnabled(true);
+	ui->modelUnload->setEnabled(true);
+
 	if(ModelGet(this->cur_model) != NULL) ModelRelease(this->cur_model);
-	this->cur_model = ModelCurID();
-	ModelTake(this->cur_model);
+	ModelSetCurrent(id);
+	this->cur_model = id;
+	modelPath = path;
 
 	AprilASRModel model = ModelGet(this->cur_model);
 
@@ -128,8 +186,12 @@ bool CatpionUI::modelLoad(const char * path)
 	ui->modelLang->setText(aam_get_language(model));
 	ui->modelRate->setText(QString("%1").arg(aam_get_sample_rate(model)));
 	ui->modelPathValue->setText(path);
+	if (prewarm_ns)
+		ui->modelPrewarmTime->setText(QString("%1 ms").arg(prewarm_ns / 1000000.0, 0, 'f', 0));
+	else
+		ui->modelPrewarmTime->setText("...");
 	obs_enum_sources(push_model_reload, NULL);	
-	return true;
+	SessionPoolTrim();
 }
 
 void CatpionUI::modelUnloadButton()
@@ -144,10 +206,13 @@ void CatpionUI::modelUnloadButton()
 	ui->modelLang->setText("...");
 	ui->modelRate->setText("...");
 	ui->modelPathValue->setText("...");
+	ui->modelPrewarmTime->setText("...");
+	modelPath.clear();
 
 	saveSettings("");
 
 	obs_enum_sources(push_model_reload, NULL);
+	SessionPoolTrim();
 
 }
 
@@ -162,6 +227,17 @@ void CatpionUI::showHideDialog()
 	}
 }
 
+extern "C" void CatpionLoadModel(const char *path)
+{
+	auto load = [](void *param) {
+		char *model_path = (char *)param;
+		if (cui->modelLoad(model_path))
+			cui->saveSettings(model_path);
+		bfree(model_path);
+	};
+	obs_queue_task(OBS_TASK_UI, load, bstrdup(path), false);
+}
+
 extern "C" void InitCatpionUI()
 {
     QAction *action = (QAction *)obs_frontend_add_tools_menu_qaction(
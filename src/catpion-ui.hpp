@@ -3,6 +3,7 @@
 #include <util/platform.h>
 #include <obs.hpp>
 #include <memory>
+#include <string>
 #include "ui_catpion.h"
 
 class CatpionUI : public QDialog {
@@ -17,6 +18,7 @@ public:
 	void saveSettings(const char *);
 	void loadSettings();
 	bool modelLoad(const char * path);
+	void modelReady(size_t id, const char *path, uint64_t prewarm_ns);
 
 public slots:
     void modelLoadButton();
@@ -24,4 +26,6 @@ public slots:
 	void showHideDialog();
 private:
 	size_t cur_model;
+	std::string modelPath;
+	bool prewarming = false;
 };
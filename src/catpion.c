@@ -29,6 +29,7 @@
 #include <util/dstr.h>
 #include <util/platform.h>
 #include <util/threading.h>
+#include <util/task.h>
 
 #include <pipewire/pipewire.h>
 #include <pango/pangocairo.h>
@@ -38,11 +39,15 @@
 #include "obs-text-pthread.h"
 #include "line-gen.h"
 #include "model.h"
+#include "source-capture.h"
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("catpion", "en-US")
 
 static gs_effect_t *textalpha_effect = NULL;
+static volatile bool effect_queued = false;
+/* session and output changes, one source at a time */
+static os_task_queue_t *config_queue = NULL;
 
 #define tp_data_get_color(s, c) tp_data_get_color2(s, c, c ".alpha")
 static inline uint32_t tp_data_get_color2(obs_data_t *settings, const char *color, const char *alpha)
@@ -85,6 +90,8 @@ struct target_node {
 void handler(void *data, AprilResultType result, size_t count, const AprilToken *tokens) {
 	struct obs_audio_caption_src *acs = data;
 
+	pthread_mutex_lock(&acs->lg_mutex);
+
     switch(result) {
         case APRIL_RESULT_RECOGNITION_PARTIAL:
         case APRIL_RESULT_RECOGNITION_FINAL:
@@ -94,6 +101,8 @@ void handler(void *data, AprilResultType result, size_t count, const AprilToken
                 line_generator_finalize(&acs->lg);
             }
             line_generator_set_text(&acs->lg);
+            line_generator_send_outputs(&acs->lg, result, count, tokens);
+            line_generator_send_bundle(&acs->lg, result, count, tokens);
             break;
         }
 
@@ -105,9 +114,12 @@ void handler(void *data, AprilResultType result, size_t count, const AprilToken
         case APRIL_RESULT_SILENCE: {
             line_generator_break(&acs->lg);
             line_generator_set_text(&acs->lg);
+            line_generator_send_bundle(&acs->lg, result, 0, NULL);
             break;
         }
     }
+
+	pthread_mutex_unlock(&acs->lg_mutex);
 }
 
 struct target_node *get_node_by_name(struct obs_audio_caption_src *acs, const char *name)
@@ -134,12 +146,17 @@ struct target_node *get_node_by_serial(struct obs_audio_caption_src *acs, uint32
 	return NULL;
 }
 
+static void queue_reconfigure(struct obs_audio_caption_src *acs);
+
 static void start_streaming(struct obs_audio_caption_src *acs, struct target_node *node)
 {
 	if (!node || !node->channels) {
 		return;
 	}
-	if (acs->session == NULL) return;
+	/* idle and split sources follow their device at the model's rate */
+	if (!acs->model_sample_rate) return;
+	/* audio comes from an OBS source instead */
+	if (source_capture_active(&acs->capture)) return;
 
 	dstr_copy(&acs->target_name, node->name);
 
@@ -151,9 +168,15 @@ static void start_streaming(struct obs_audio_caption_src *acs, struct target_nod
 		pw_stream_disconnect(acs->pw.audio.stream);
 	}
 
-	if (obs_pw_audio_stream_connect(&acs->pw.audio, node->serial, node->channels, acs->model_sample_rate) == 0) {
+	if (obs_pw_audio_stream_connect(&acs->pw.audio, node->serial, node->channels, acs->model_sample_rate,
+					acs->latency_ms) == 0) {
 		acs->connected_serial = node->serial;
+		acs->on_fallback = false;
 		blog(LOG_INFO, "[catpion] %p streaming from %u", acs->pw.audio.stream, node->serial);
+		if (acs->split_enabled) {
+			/* the new device may have a different number of channels */
+			queue_reconfigure(acs);
+		}
 	} else {
 		acs->connected_serial = SPA_ID_INVALID;
 		blog(LOG_WARNING, "[catpion] Error connecting stream %p", acs->pw.audio.stream);
@@ -199,12 +222,13 @@ static void on_node_info_cb(void *data, const struct pw_node_info *info)
 	n->channels = c;
 
 	struct obs_audio_caption_src *acs = n->acs;
+	input_mix_node_added(acs, n->name, n->friendly_name, n->serial, c);
 
 	/** If this is the default device and the stream is not already connected to it
-	  * or the stream is unconnected and this node has the desired target name */
+	  * or the stream is unconnected or on a fallback and this node has the desired target name */
 	if ((acs->default_info.autoconnect && acs->connected_serial != n->serial &&
 		 !dstr_is_empty(&acs->default_info.name) && dstr_cmp(&acs->default_info.name, n->name) == 0) ||
-		(pw_stream_get_state(acs->pw.audio.stream, NULL) == PW_STREAM_STATE_UNCONNECTED &&
+		((acs->on_fallback || pw_stream_get_state(acs->pw.audio.stream, NULL) == PW_STREAM_STATE_UNCONNECTED) &&
 		 !dstr_is_empty(&acs->target_name) && dstr_cmp(&acs->target_name, n->name) == 0)) {
 		start_streaming(acs, n);
 	}
@@ -257,8 +281,15 @@ static void on_global_cb(void *data, uint32_t id, uint32_t permissions, const ch
 			return;
 		}
 
-		/* Target device */
-		if(strcmp(media_class, "Audio/Source") == 0 || strcmp(media_class, "Audio/Source/Virtual") == 0) {
+		/* Target device, sinks are captured through their monitor */
+		bool is_target;
+		if (acs->capture_sink) {
+			is_target = strcmp(media_class, "Audio/Sink") == 0;
+		} else {
+			is_target = strcmp(media_class, "Audio/Source") == 0 ||
+				    strcmp(media_class, "Audio/Source/Virtual") == 0;
+		}
+		if(is_target) {
 
 			const char *ser = spa_dict_lookup(props, PW_KEY_OBJECT_SERIAL);
 			if (!ser) {
@@ -285,7 +316,7 @@ static void on_global_cb(void *data, uint32_t id, uint32_t permissions, const ch
 
 		if (!obs_pw_audio_default_node_metadata_listen(
 				&acs->default_info.metadata, &acs->pw, id,
-				false, default_node_cb, acs)) {
+				acs->capture_sink, default_node_cb, acs)) {
 			blog(LOG_WARNING, "[catpion] Failed to get default metadata, cannot detect default audio devices");
 		}
 	}
@@ -313,6 +344,56 @@ static const char *catpion_audio_output_name(void *data)
 	return obs_module_text("Catpion Audio Output");
 }
 
+/* First listed device that is present and whose channels are known */
+static struct target_node *find_fallback(struct obs_audio_caption_src *acs, uint32_t lost_serial)
+{
+	const char *p = acs->fallbacks;
+	while (p && *p) {
+		size_t len = strcspn(p, "\r\n");
+		struct target_node *n;
+		obs_pw_audio_proxy_list_for_each(&acs->targets, n)
+		{
+			if (n->serial == lost_serial || !n->channels || !len) {
+				continue;
+			}
+			if ((strncmp(n->name, p, len) == 0 && n->name[len] == '\0') ||
+			    (strncmp(n->friendly_name, p, len) == 0 && n->friendly_name[len] == '\0')) {
+				return n;
+			}
+		}
+		p += len;
+		while (*p == '\r' || *p == '\n') {
+			p++;
+		}
+	}
+	return NULL;
+}
+
+/* Switch to a fallback right away, the session is kept so no context is lost */
+static void failover(struct obs_audio_caption_src *acs, struct target_node *lost)
+{
+	uint64_t start_ns = os_gettime_ns();
+	struct target_node *next = find_fallback(acs, lost->serial);
+	if (!next) {
+		return;
+	}
+
+	/* keep waiting for the wanted device to come back */
+	struct dstr wanted = {0};
+	dstr_copy_dstr(&wanted, &acs->target_name);
+	start_streaming(acs, next);
+	dstr_free(&acs->target_name);
+	acs->target_name = wanted;
+
+	if (acs->connected_serial != next->serial) {
+		return;
+	}
+	acs->on_fallback = true;
+	os_atomic_set_long(&acs->failover_start_ns, (long)start_ns);
+	blog(LOG_INFO, "[catpion] %s: %s disappeared, failed over to %s in %.2f ms", obs_source_get_name(acs->source),
+	     lost->name, next->name, (os_gettime_ns() - start_ns) / 1000000.0);
+}
+
 static void node_destroy_cb(void *data)
 {
 	struct target_node *n = data;
@@ -323,7 +404,9 @@ static void node_destroy_cb(void *data)
 			pw_stream_disconnect(acs->pw.audio.stream);
 		}
 		acs->connected_serial = SPA_ID_INVALID;
+		failover(acs, n);
 	}
+	input_mix_node_removed(acs, n->serial);
 
 	spa_hook_remove(&n->node_listener);
 
@@ -351,8 +434,8 @@ static void tp_update(void *data, obs_data_t *settings)
 		obs_data_release(font_obj);
 	}
 
-	BFREE_IF_NONNULL(src->config.text);
-	src->config.text = bstrdup("[CC]");
+	text_snapshot_release(src->config.text);
+	src->config.text = text_snapshot_create("[CC]");
 
 	src->config.color = tp_data_get_color(settings, "color");
 
@@ -381,75 +464,322 @@ static void tp_update(void *data, obs_data_t *settings)
 	src->config_updated = true;
 
 	pthread_mutex_unlock(&src->config_mutex);
-}
 
-void check_cur_session(struct obs_audio_caption_src *acs) {
-    AprilConfig config = { 0 };
-    config.handler = handler;
-    config.userdata = (void*)acs;
-    config.flags = APRIL_CONFIG_FLAG_ASYNC_RT_BIT;
+	tp_queue_render(src);
+}
 
-	size_t model_id = ModelCurID();
+static void tp_add_render_info(obs_properties_t *props, struct tp_source *src)
+{
+	struct tp_render_stats stats;
+	tp_get_render_stats(src, &stats);
+
+	struct dstr info = {0};
+	if (stats.jobs) {
+		dstr_printf(&info, obs_module_text("Drew %llu of %llu text updates, %.1f ms each"),
+			    (unsigned long long)stats.jobs, (unsigned long long)stats.requests,
+			    stats.render_ns_total / 1000000.0 / stats.jobs);
+		dstr_catf(&info, obs_module_text("\nWaited %.1f ms for a render thread on average, %.1f ms at most, "
+						  "%llu times too long"),
+			  stats.queue_ns_total / 1000000.0 / stats.jobs, stats.queue_ns_max / 1000000.0,
+			  (unsigned long long)stats.late_jobs);
+	} else {
+		dstr_copy(&info, obs_module_text("Nothing drawn yet"));
+	}
+	obs_properties_add_text(props, "render_timing", info.array, OBS_TEXT_INFO);
+	dstr_free(&info);
+}
 
-	if(acs->session != NULL){
-		if(model_id == acs->model_id){
-			return;
-		}
+/* Lines are broken in pixels against the text width, with some room left
+ * for kerning the glyph advances don't account for */
+static void update_line_metrics(struct obs_audio_caption_src *acs)
+{
+	pthread_mutex_lock(&acs->text_src.config_mutex);
+	char *font_name = bstrdup(acs->text_src.config.font_name);
+	uint32_t font_size = acs->text_src.config.font_size;
+	uint32_t font_flags = acs->text_src.config.font_flags;
+	int width = (int)acs->text_src.config.width - abs(acs->text_src.config.indent);
+	pthread_mutex_unlock(&acs->text_src.config_mutex);
+
+	struct text_font_cache *font = text_font_cache_get(font_name, font_size, font_flags);
+	bfree(font_name);
+
+	width -= width / 20;
+	if (width < 1)
+		width = 1;
+
+	pthread_mutex_lock(&acs->lg_mutex);
+	struct text_font_cache *old = acs->font_cache;
+	acs->font_cache = font;
+	line_generator_set_font(&acs->lg, font, width);
+	channel_split_set_font(&acs->split, font, width);
+	acs->split.has_hash = false;
+	/* tp_update put the placeholder text back on screen, resend the captions */
+	line_generator_set_label(&acs->lg, &acs->text_src);
+	pthread_mutex_unlock(&acs->lg_mutex);
+
+	text_font_cache_release(old);
+
+	pthread_mutex_lock(&acs->text_src.config_mutex);
+	acs->text_src.config.prewrapped = font != NULL;
+	acs->text_src.config_updated = true;
+	pthread_mutex_unlock(&acs->text_src.config_mutex);
+	tp_queue_render(&acs->text_src);
+}
 
-		blog(
-			LOG_INFO, "[catpion] Captioning session released m[%d] %ld %d", 
-			acs->model_id,
-			acs->session,
-			acs->model_sample_rate);
+static void update_line_layout(struct obs_audio_caption_src *acs, obs_data_t *settings)
+{
+	pthread_mutex_lock(&acs->lg_mutex);
+	line_generator_set_layout(&acs->lg, (size_t)obs_data_get_int(settings, "line_count"),
+				  (size_t)obs_data_get_int(settings, "history_depth"));
+	pthread_mutex_unlock(&acs->lg_mutex);
+}
 
-		pw_thread_loop_lock(acs->pw.thread_loop);
-		aas_flush(acs->session);
-		aas_free(acs->session);
-		line_generator_end(&acs->lg);
-		acs->session = NULL;
-		ModelRelease(acs->model_id);
-	}
-	else
-	{
-		pw_thread_loop_lock(acs->pw.thread_loop);
+/* Streams connect at the model's rate, known before any session exists */
+static void update_model_rate(struct obs_audio_caption_src *acs)
+{
+	AprilASRModel model = ModelGet(ModelCurID());
+	if (!model) {
+		return;
 	}
+	pw_thread_loop_lock(acs->pw.thread_loop);
+	acs->model_sample_rate = aam_get_sample_rate(model);
+	pw_thread_loop_unlock(acs->pw.thread_loop);
+}
 
+void check_cur_session(struct obs_audio_caption_src *acs) {
+	size_t model_id = ModelCurID();
 	AprilASRModel model = ModelGet(model_id);
+	/* idle sources have none, split channels have their own */
+	bool wanted = model && !acs->idle && !acs->split_enabled;
+
+	if(wanted ? (acs->pooled != NULL && model_id == acs->model_id) : acs->pooled == NULL){
+		if(model && acs->model_sample_rate != aam_get_sample_rate(model)){
+			pw_thread_loop_lock(acs->pw.thread_loop);
+			acs->model_sample_rate = aam_get_sample_rate(model);
+			pw_thread_loop_unlock(acs->pw.thread_loop);
+			source_capture_set_session(&acs->capture, acs->session, acs->model_sample_rate);
+		}
+		return;
+	}
+
+	/* Creating a session is slow, do it before taking the audio loop */
+	struct pooled_session *ps = wanted ? SessionAcquire(model_id, handler, acs) : NULL;
+
+	pw_thread_loop_lock(acs->pw.thread_loop);
+	struct pooled_session *old = acs->pooled;
+	acs->pooled = ps;
+	acs->session = ps ? ps->session : NULL;
 	if(model){
 		acs->model_id = model_id;
-		ModelTake(model_id);
-		line_generator_init(&acs->lg);
-		acs->session = aas_create_session(model, config);
 		acs->model_sample_rate = aam_get_sample_rate(model);
+	}
+	pw_thread_loop_unlock(acs->pw.thread_loop);
+	source_capture_set_session(&acs->capture, acs->session, acs->model_sample_rate);
+
+	if(old){
 		blog(
-			LOG_INFO, "[catpion] Captioning session created m[%d] %ld %d", 
+			LOG_INFO, "[catpion] Captioning session released m[%d] %p",
+			old->model_id,
+			old->session);
+		SessionRelease(old);
+	}
+
+	pthread_mutex_lock(&acs->lg_mutex);
+	if(old){
+		line_generator_end(&acs->lg);
+	}
+	if(ps){
+		blog(
+			LOG_INFO, "[catpion] Captioning session acquired m[%d] %p %d",
 			model_id,
-			acs->session,
+			ps->session,
 			acs->model_sample_rate);
+		line_generator_init(&acs->lg);
+		line_generator_set_label(&acs->lg, &acs->text_src);
+		line_generator_set_fanout(&acs->lg, &acs->fanout);
 	}
+	pthread_mutex_unlock(&acs->lg_mutex);
+}
 
-	if(acs->session != NULL){
-		line_generator_set_label(&acs->lg, &acs->text_src);
+static void update_caption_outputs(struct obs_audio_caption_src *acs, obs_data_t *settings)
+{
+	/* the checkbox only covers the local OSC port, other destinations stand on their own */
+	struct dstr dests = {0};
+	int port = (int)obs_data_get_int(settings, "osc_port");
+	if (obs_data_get_bool(settings, "osc_send") && port > 0) {
+		dstr_catf(&dests, "udp://127.0.0.1:%d\n", port);
 	}
-	pw_thread_loop_unlock(acs->pw.thread_loop);
+	dstr_cat(&dests, obs_data_get_string(settings, "osc_destinations"));
+
+	uint32_t frontend = 0;
+	if (obs_data_get_bool(settings, "obs_output_caption_stream"))
+		frontend |= CAPTION_OUTPUT_STREAM;
+	if (obs_data_get_bool(settings, "caption_recording"))
+		frontend |= CAPTION_OUTPUT_RECORDING;
+	if (obs_data_get_bool(settings, "caption_replay_buffer"))
+		frontend |= CAPTION_OUTPUT_REPLAY_BUFFER;
+	/* The result handler reads the sinks under lg_mutex, and the fanout
+	 * ring and shared memory go away with their last user */
+	pthread_mutex_lock(&acs->lg_mutex);
+	bool outputs_active =
+		caption_outputs_set_targets(&acs->outputs, frontend, obs_data_get_string(settings, "caption_outputs"));
+	line_generator_set_outputs(&acs->lg, outputs_active ? &acs->outputs : NULL);
+	acs->lg.to_osc = caption_fanout_set_destinations(&acs->fanout, dests.array);
+	acs->lg.osc_bundle = obs_data_get_bool(settings, "osc_bundle");
+
+	bool shm_active = caption_shm_set_name(&acs->shm, obs_data_get_string(settings, "shm_name"));
+	line_generator_set_shm(&acs->lg, shm_active ? &acs->shm : NULL);
+	pthread_mutex_unlock(&acs->lg_mutex);
+
+	osc_control_set_port(&acs->control, (int)obs_data_get_int(settings, "osc_control_port"),
+			     obs_data_get_bool(settings, "osc_control_any_host"));
+
+	dstr_free(&dests);
 }
 
 void release_session(struct obs_audio_caption_src *acs){
-	if(acs->session != NULL){
-		aas_flush(acs->session);
-		aas_free(acs->session);
+	if(acs->pooled != NULL){
+		SessionRelease(acs->pooled);
 		line_generator_end(&acs->lg);
-		ModelRelease(acs->model_id);
+		acs->pooled = NULL;
 		acs->session = NULL;
 	}
 }
 
-static void *catpion_audio_input_create(obs_data_t *settings, obs_source_t *source)
+/* Split the device's channels once it's known how many it has */
+static void update_channel_split(struct obs_audio_caption_src *acs, obs_data_t *settings)
+{
+	size_t channels = 0;
+	if (acs->split_enabled && !acs->idle && !source_capture_active(&acs->capture) && ModelGet(ModelCurID())) {
+		pw_thread_loop_lock(acs->pw.thread_loop);
+		struct target_node *node = get_node_by_serial(acs, acs->connected_serial);
+		channels = node ? node->channels : 0;
+		pw_thread_loop_unlock(acs->pw.thread_loop);
+	}
+	channel_split_configure(acs, channels, obs_data_get_string(settings, "channel_labels"));
+}
+
+/* Other devices are mixed in unless the main one is split or an OBS source is captioned */
+static void update_input_mix(struct obs_audio_caption_src *acs, obs_data_t *settings)
+{
+	const char *inputs = obs_data_get_string(settings, "mix_inputs");
+	const char *ignored_for = NULL;
+	if (acs->split_enabled)
+		ignored_for = "channels are split";
+	else if (source_capture_active(&acs->capture))
+		ignored_for = "captioning an OBS source";
+
+	bool ignored = ignored_for && inputs && *inputs;
+	if (ignored && !acs->mix_ignored) {
+		blog(LOG_WARNING, "[catpion] %s: not mixing in other devices while %s", obs_source_get_name(acs->source),
+		     ignored_for);
+	}
+	acs->mix_ignored = ignored;
+	if (ignored_for)
+		inputs = NULL;
+	input_mix_configure(acs, inputs, obs_data_get_double(settings, "mix_gain"));
+
+	pw_thread_loop_lock(acs->pw.thread_loop);
+	struct target_node *n;
+	obs_pw_audio_proxy_list_for_each(&acs->targets, n)
+	{
+		input_mix_node_added(acs, n->name, n->friendly_name, n->serial, n->channels);
+	}
+	pw_thread_loop_unlock(acs->pw.thread_loop);
+}
+
+/**
+ * Bring the session, split channels and outputs in line with the settings
+ * and visibility. Idle sources give their session back to the pool and
+ * stop the audio.
+ * @warning Only run on the config queue, which keeps session creation off
+ * the UI thread and serializes it
+ */
+static void reconfigure(struct obs_audio_caption_src *acs)
+{
+	/* shown mirrors need the captions as much as the source itself */
+	bool idle = !os_atomic_load_bool(&acs->showing) && !os_atomic_load_bool(&acs->keep_hidden) &&
+		    os_atomic_load_long(&acs->mirror_holds) == 0;
+	bool changed = idle != acs->idle;
+
+	pw_thread_loop_lock(acs->pw.thread_loop);
+	acs->idle = idle;
+	pw_stream_set_active(acs->pw.audio.stream, !idle);
+	input_mix_set_active(&acs->mix, !idle);
+	pw_thread_loop_unlock(acs->pw.thread_loop);
+
+	check_cur_session(acs);
+	obs_data_t *settings = obs_source_get_settings(acs->source);
+	update_channel_split(acs, settings);
+	if (!idle) {
+		/* line_generator_end cleared the outputs */
+		update_caption_outputs(acs, settings);
+	}
+	obs_data_release(settings);
+
+	if (acs->create_ns) {
+		blog(LOG_INFO, "[catpion] %s: started %s %.1f ms after creation", obs_source_get_name(acs->source),
+		     idle ? "idle" : "captioning", (os_gettime_ns() - acs->create_ns) / 1000000.0);
+		acs->create_ns = 0;
+	} else if (changed) {
+		blog(LOG_INFO, "[catpion] %s: %s", obs_source_get_name(acs->source),
+		     idle ? "idle while hidden" : "captioning resumed");
+	}
+}
+
+/* The source's data isn't set until create returns, which the queue may
+ * not wait for, so the task carries the source state itself */
+struct reconfigure_job {
+	obs_weak_source_t *weak;
+	struct obs_audio_caption_src *acs;
+};
+
+static void reconfigure_task(void *param)
+{
+	struct reconfigure_job *job = param;
+	/* the strong reference keeps acs from being destroyed meanwhile */
+	obs_source_t *source = obs_weak_source_get_source(job->weak);
+	obs_weak_source_release(job->weak);
+	if (source) {
+		reconfigure(job->acs);
+		obs_source_release(source);
+	}
+	bfree(job);
+}
+
+static void queue_reconfigure(struct obs_audio_caption_src *acs)
+{
+	struct reconfigure_job *job = bmalloc(sizeof(struct reconfigure_job));
+	job->weak = obs_source_get_weak_source(acs->source);
+	job->acs = acs;
+	os_task_queue_queue_task(config_queue, reconfigure_task, job);
+}
+
+/* The render callback skips drawing until the effect is in, loaded once by the first source */
+static void load_effect_task(void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	uint64_t start_ns = os_gettime_ns();
+	char *f = obs_module_file("textalpha.effect");
+	gs_effect_t *effect = gs_effect_create_from_file(f, NULL);
+	if (!effect)
+		blog(LOG_ERROR, "[catpion] Cannot load '%s'", f);
+	else
+		blog(LOG_INFO, "[catpion] Loaded '%s' in %.1f ms", f, (os_gettime_ns() - start_ns) / 1000000.0);
+	bfree(f);
+	textalpha_effect = effect;
+}
+
+static void *catpion_create(obs_data_t *settings, obs_source_t *source, bool capture_sink)
 {
+	uint64_t start_ns = os_gettime_ns();
 	struct obs_audio_caption_src *acs = bzalloc(sizeof(struct obs_audio_caption_src));
+	acs->capture_sink = capture_sink;
+	acs->latency_ms = (uint32_t)obs_data_get_int(settings, "node_latency");
 
 	if (!obs_pw_audio_instance_init(
-			&acs->pw, &registry_events, acs, false, true, acs)) {
+			&acs->pw, &registry_events, acs, capture_sink, true, acs)) {
 		obs_pw_audio_instance_destroy(&acs->pw);
 
 		bfree(acs);
@@ -473,39 +803,60 @@ static void *catpion_audio_input_create(obs_data_t *settings, obs_source_t *sour
 
 	dstr_init_copy(&acs->target_name, obs_data_get_string(settings, "TargetName"));
 
+	/* devices show up through the registry callbacks, no need to wait */
 	obs_pw_audio_instance_sync(&acs->pw);
-	pw_thread_loop_wait(acs->pw.thread_loop);
 	pw_thread_loop_unlock(acs->pw.thread_loop);
 
-	obs_enter_graphics();
-	if (!textalpha_effect) {
-		char *f = obs_module_file("textalpha.effect");
-		textalpha_effect = gs_effect_create_from_file(f, NULL);
-		if (!textalpha_effect)
-			blog(LOG_ERROR, "[catpion] Cannot load '%s'", f);
-		bfree(f);
+	if (!os_atomic_exchange_bool(&effect_queued, true)) {
+		obs_queue_task(OBS_TASK_GRAPHICS, load_effect_task, NULL, false);
 	}
-	obs_leave_graphics();
 
 	pthread_mutex_init(&acs->text_src.config_mutex, NULL);
 	pthread_mutex_init(&acs->text_src.tex_mutex, NULL);
+	pthread_mutex_init(&acs->lg_mutex, NULL);
 
 	tp_update(&acs->text_src, settings);
+	update_line_metrics(acs);
+	update_line_layout(acs, settings);
 
 	tp_thread_start(&acs->text_src);
 
-	check_cur_session(acs);
-	if(acs->session != NULL){
-		acs->lg.to_stream = obs_data_get_bool(settings, "obs_output_caption_stream");
-		acs->lg.to_osc = obs_data_get_bool(settings, "osc_send");
-		acs->lg.osc_port = obs_data_get_int(settings, "osc_port");
-	}
+	caption_fanout_init(&acs->fanout);
+	source_capture_init(&acs->capture, acs);
+	caption_shm_init(&acs->shm);
+	caption_outputs_init(&acs->outputs);
+	osc_control_init(&acs->control, acs);
+
+	/* the placeholder text shows until the config queue creates the session */
+	acs->split_enabled = obs_data_get_bool(settings, "split_channels");
+	acs->idle = true;
+	update_model_rate(acs);
+	source_capture_set_target(&acs->capture, obs_data_get_string(settings, "audio_source"));
+	update_input_mix(acs, settings);
+
+	/* sources start hidden, go idle unless show comes first */
+	acs->keep_hidden = obs_data_get_bool(settings, "keep_captioning_hidden");
+	acs->create_ns = start_ns;
+	queue_reconfigure(acs);
+
+	blog(LOG_INFO, "[catpion] %s: created in %.2f ms", obs_source_get_name(source),
+	     (os_gettime_ns() - start_ns) / 1000000.0);
 	return acs;
 }
 
-static void catpion_defaults(obs_data_t *settings)
+static void *catpion_audio_input_create(obs_data_t *settings, obs_source_t *source)
+{
+	return catpion_create(settings, source, false);
+}
+
+static void *catpion_audio_output_create(obs_data_t *settings, obs_source_t *source)
+{
+	return catpion_create(settings, source, true);
+}
+
+/* Styling shared by caption and mirror sources */
+static void tp_defaults(obs_data_t *settings)
 {
-	obs_data_set_default_int(settings, "TargetId", PW_ID_ANY);
 	{
 		obs_data_t *font_obj = obs_data_create();
 		obs_data_set_default_int(font_obj, "size", 64);
@@ -531,10 +882,35 @@ static void catpion_defaults(obs_data_t *settings)
 	obs_data_set_default_int(settings, "shadow_color.alpha", 0xFF);
 
 	obs_data_set_default_bool(settings, "outline_blur_gaussian", true);
+}
+
+static void catpion_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_int(settings, "TargetId", PW_ID_ANY);
+	obs_data_set_default_string(settings, "audio_source", "");
+	tp_defaults(settings);
+
+	obs_data_set_default_int(settings, "line_count", AC_LINE_COUNT);
+	obs_data_set_default_int(settings, "history_depth", 100);
 
 	obs_data_set_default_bool(settings, "obs_output_caption_stream", false);
+	obs_data_set_default_bool(settings, "caption_recording", false);
+	obs_data_set_default_bool(settings, "caption_replay_buffer", false);
+	obs_data_set_default_string(settings, "caption_outputs", "");
 	obs_data_set_default_bool(settings, "osc_send", false);
 	obs_data_set_default_int(settings, "osc_port", 5050);
+	obs_data_set_default_bool(settings, "osc_bundle", false);
+	obs_data_set_default_string(settings, "osc_destinations", "");
+	obs_data_set_default_string(settings, "shm_name", "");
+	obs_data_set_default_int(settings, "osc_control_port", 0);
+	obs_data_set_default_bool(settings, "keep_captioning_hidden", false);
+	obs_data_set_default_bool(settings, "split_channels", false);
+	obs_data_set_default_string(settings, "channel_labels", "");
+	obs_data_set_default_string(settings, "mix_inputs", "");
+	obs_data_set_default_double(settings, "mix_gain", 0.0);
+	obs_data_set_default_int(settings, "node_latency", 0);
+	obs_data_set_default_string(settings, "fallback_devices", "");
+	obs_data_set_default_bool(settings, "osc_control_any_host", false);
 }
 
 static bool tp_prop_outline_changed(obs_properties_t *props, obs_property_t *property, obs_data_t *settings)
@@ -565,36 +941,35 @@ static bool tp_prop_shadow_changed(obs_properties_t *props, obs_property_t *prop
 	return true;
 }
 
-static obs_properties_t *catpion_properties(void *data)
+/* Split channels each get their own recognizer, there is no single session to mix into */
+static bool prop_split_channels_changed(obs_properties_t *props, obs_property_t *property, obs_data_t *settings)
 {
-	struct obs_audio_caption_src *acs = data;
-
-	obs_properties_t *props;
-	obs_property_t *prop;
-	props = obs_properties_create();
-
-	prop =
-		obs_properties_add_list(props, "TargetId", obs_module_text("Device"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-
-	obs_property_list_add_int(prop, obs_module_text("Default"), PW_ID_ANY);
+	UNUSED_PARAMETER(property);
 
-	if (!acs->default_info.autoconnect) {
-		obs_data_t *settings = obs_source_get_settings(acs->source);
-		/* Saved target serial may be different from connected because a previously connected
-		   node may have been replaced by one with the same name */
-		obs_data_set_int(settings, "TargetId", acs->connected_serial);
-		obs_data_release(settings);
-	}
+	bool split = settings ? obs_data_get_bool(settings, "split_channels") : false;
+	obs_property_set_enabled(obs_properties_get(props, "mix_inputs"), !split);
+	obs_property_set_enabled(obs_properties_get(props, "mix_gain"), !split);
 
-	pw_thread_loop_lock(acs->pw.thread_loop);
+	return true;
+}
 
-	struct target_node *n;
-	obs_pw_audio_proxy_list_for_each(&acs->targets, n)
-	{
-		obs_property_list_add_int(prop, n->friendly_name, n->serial);
+static bool add_audio_source(void *data, obs_source_t *source)
+{
+	obs_property_t *prop = data;
+	uint32_t flags = obs_source_get_output_flags(source);
+	const char *id = obs_source_get_id(source);
+	/* caption sources have no audio of their own */
+	if ((flags & OBS_SOURCE_AUDIO) && strcmp(id, "catpion_audio_input") != 0 &&
+	    strcmp(id, "catpion_audio_output") != 0) {
+		const char *name = obs_source_get_name(source);
+		obs_property_list_add_string(prop, name, name);
 	}
+	return true;
+}
 
-	pw_thread_loop_unlock(acs->pw.thread_loop);
+static void tp_add_text_properties(obs_properties_t *props)
+{
+	obs_property_t *prop;
 
 	obs_properties_add_font(props, "font", obs_module_text("Font"));
 
@@ -631,6 +1006,11 @@ static obs_properties_t *catpion_properties(void *data)
 	obs_property_list_add_int(prop, obs_module_text("Ellipsize.End"), PANGO_ELLIPSIZE_END);
 
 	obs_properties_add_int(props, "spacing", obs_module_text("Line spacing"), -65536, +65536, 1);
+}
+
+static void tp_add_effect_properties(obs_properties_t *props)
+{
+	obs_property_t *prop;
 
 	// TODO: vertical
 
@@ -652,10 +1032,126 @@ static obs_properties_t *catpion_properties(void *data)
 	tp_data_add_color(props, "shadow_color", obs_module_text("Shadow color"));
 	obs_properties_add_int(props, "shadow_x", obs_module_text("Shadow offset x"), -65536, 65536, 1);
 	obs_properties_add_int(props, "shadow_y", obs_module_text("Shadow offset y"), -65536, 65536, 1);
+}
+
+static obs_properties_t *catpion_properties(void *data)
+{
+	struct obs_audio_caption_src *acs = data;
+
+	obs_properties_t *props;
+	obs_property_t *prop;
+	props = obs_properties_create();
+
+	prop = obs_properties_add_list(props, "audio_source", obs_module_text("Audio from"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(prop, obs_module_text("PipeWire device"), "");
+	obs_enum_sources(add_audio_source, prop);
+	obs_property_set_long_description(
+		prop, obs_module_text("Caption an OBS source after its filters instead of opening the device again"));
+
+	prop =
+		obs_properties_add_list(props, "TargetId", obs_module_text("Device"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+
+	obs_property_list_add_int(prop, obs_module_text("Default"), PW_ID_ANY);
+
+	if (!acs->default_info.autoconnect) {
+		obs_data_t *settings = obs_source_get_settings(acs->source);
+		/* Saved target serial may be different from connected because a previously connected
+		   node may have been replaced by one with the same name */
+		obs_data_set_int(settings, "TargetId", acs->connected_serial);
+		obs_data_release(settings);
+	}
+
+	pw_thread_loop_lock(acs->pw.thread_loop);
+
+	struct target_node *n;
+	obs_pw_audio_proxy_list_for_each(&acs->targets, n)
+	{
+		obs_property_list_add_int(prop, n->friendly_name, n->serial);
+	}
+
+	pw_thread_loop_unlock(acs->pw.thread_loop);
+
+	tp_add_text_properties(props);
+	obs_properties_add_int(props, "line_count", obs_module_text("Caption lines"), 1, AC_LINE_COUNT_MAX, 1);
+	prop = obs_properties_add_int(props, "history_depth", obs_module_text("Caption history lines"), 0,
+				      AC_HISTORY_DEPTH_MAX, 1);
+	obs_property_set_long_description(prop, obs_module_text("Finished lines kept after they scroll out of view, sent back on /catpion/history"));
+
+	tp_add_effect_properties(props);
 
 	obs_properties_add_bool(props, "obs_output_caption_stream", obs_module_text("Send captions to stream"));
+	obs_properties_add_bool(props, "caption_recording", obs_module_text("Send captions to recording"));
+	obs_properties_add_bool(props, "caption_replay_buffer", obs_module_text("Send captions to replay buffer"));
+	prop = obs_properties_add_text(props, "caption_outputs", obs_module_text("Additional caption outputs"),
+				       OBS_TEXT_MULTILINE);
+	obs_property_set_long_description(
+		prop, obs_module_text("Names of other outputs to caption, one per line, e.g. ones added by multistream plugins"));
 	obs_properties_add_bool(props, "osc_send", obs_module_text("Send captions through OSC locally"));
 	obs_properties_add_int(props, "osc_port", obs_module_text("OSC UDP port"), 0, 65536, 1);
+	obs_properties_add_bool(props, "osc_bundle", obs_module_text("Send OSC bundles with word timings"));
+	prop = obs_properties_add_text(props, "osc_destinations", obs_module_text("Additional caption destinations"),
+				       OBS_TEXT_MULTILINE);
+	obs_property_set_long_description(
+		prop, obs_module_text("One per line: udp://host:port, unix:///path/to/socket or file:///path/to/transcript"));
+	prop = obs_properties_add_text(props, "shm_name", obs_module_text("Shared memory feed name"), OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(
+		prop, obs_module_text("Publishes captions to /dev/shm/obs-catpion.<name> for local readers, empty disables it"));
+
+	prop = obs_properties_add_int(props, "osc_control_port", obs_module_text("OSC control UDP port"), 0, 65535, 1);
+	obs_property_set_long_description(
+		prop, obs_module_text("Accepts /catpion/break, /clear, /pause, /resume, /model <path> and /stats, 0 disables it"));
+	obs_properties_add_bool(props, "osc_control_any_host", obs_module_text("Accept OSC control from other hosts"));
+
+	prop = obs_properties_add_bool(props, "keep_captioning_hidden", obs_module_text("Keep captioning while hidden"));
+	obs_property_set_long_description(
+		prop, obs_module_text("For sources only used for OSC, shared memory or output captions, otherwise "
+				      "hidden sources give up their recognizer until shown again"));
+
+	prop = obs_properties_add_bool(props, "split_channels", obs_module_text("Caption each channel separately"));
+	obs_property_set_long_description(
+		prop, obs_module_text("Runs a recognizer per channel of the device, e.g. one microphone per channel, "
+				      "and shows a labelled line for each. Otherwise channels are mixed down. "
+				      "Other devices are not mixed in while splitting"));
+	obs_property_set_modified_callback(prop, prop_split_channels_changed);
+	prop = obs_properties_add_text(props, "channel_labels", obs_module_text("Speaker labels"), OBS_TEXT_MULTILINE);
+	obs_property_set_long_description(prop, obs_module_text("One per line, in channel order"));
+
+	prop = obs_properties_add_text(props, "mix_inputs", obs_module_text("Mix in devices"), OBS_TEXT_MULTILINE);
+	obs_property_set_long_description(
+		prop, obs_module_text("Other devices captioned together with the main one, one per line as "
+				      "\"name\" or \"name @ gain dB\", e.g. the rest of a panel's microphones"));
+	obs_properties_add_float_slider(props, "mix_gain", obs_module_text("Main device gain (dB)"), -30.0, 30.0, 0.5);
+
+	prop = obs_properties_add_text(props, "fallback_devices", obs_module_text("Fallback devices"),
+				       OBS_TEXT_MULTILINE);
+	obs_property_set_long_description(
+		prop, obs_module_text("Devices to switch to if the current one disappears, one per line in order of "
+				      "preference. Captioning goes back to the chosen device when it returns"));
+
+	prop = obs_properties_add_int(props, "node_latency", obs_module_text("Requested capture latency (ms)"), 0, 500, 1);
+	obs_property_set_long_description(
+		prop, obs_module_text("Smaller values reach the recognizer sooner but wake up more often, "
+				      "0 leaves it to the PipeWire graph"));
+	if (acs) {
+		struct obs_pw_audio_timing timing;
+		obs_pw_audio_stream_get_timing(&acs->pw.audio, &timing);
+
+		struct dstr info = {0};
+		if (timing.quantum && timing.rate) {
+			dstr_printf(&info, obs_module_text("Capturing %u frames at %u Hz per cycle (%.1f ms), %.2f ms jitter"),
+				    timing.quantum, timing.rate, timing.quantum * 1000.0 / timing.rate, timing.jitter_ms);
+			dstr_catf(&info, obs_module_text("\n%llu frames of graph gaps filled, %llu lost in %llu long gaps"),
+				  (unsigned long long)timing.filled_frames, (unsigned long long)timing.dropped_frames,
+				  (unsigned long long)timing.gap_flushes);
+		} else {
+			dstr_copy(&info, obs_module_text("Not capturing"));
+		}
+		obs_properties_add_text(props, "capture_timing", info.array, OBS_TEXT_INFO);
+		dstr_free(&info);
+
+		tp_add_render_info(props, &acs->text_src);
+	}
 
 	return props;
 }
@@ -663,17 +1159,34 @@ static obs_properties_t *catpion_properties(void *data)
 static void catpion_update(void *data, obs_data_t *settings)
 {
 	struct obs_audio_caption_src *acs = data;
-	check_cur_session(acs);
-	if(acs->session != NULL){
-		acs->lg.to_stream = obs_data_get_bool(settings, "obs_output_caption_stream");
-		acs->lg.to_osc = obs_data_get_bool(settings, "osc_send");
-		acs->lg.osc_port = obs_data_get_int(settings, "osc_port");
-	}
+	os_atomic_set_bool(&acs->keep_hidden, obs_data_get_bool(settings, "keep_captioning_hidden"));
+	update_line_layout(acs, settings);
+	acs->split_enabled = obs_data_get_bool(settings, "split_channels");
+	update_model_rate(acs);
 
 	uint32_t new_node_serial = obs_data_get_int(settings, "TargetId");
+	bool from_source = source_capture_set_target(&acs->capture, obs_data_get_string(settings, "audio_source"));
+	uint32_t latency_ms = (uint32_t)obs_data_get_int(settings, "node_latency");
 
 	pw_thread_loop_lock(acs->pw.thread_loop);
 
+	bfree(acs->fallbacks);
+	acs->fallbacks = bstrdup(obs_data_get_string(settings, "fallback_devices"));
+
+	/* the latency is requested when connecting, reconnect to change it */
+	bool relatch = latency_ms != acs->latency_ms;
+	if (relatch) {
+		blog(LOG_INFO, "[catpion] %s: requesting %u ms capture latency", obs_source_get_name(acs->source),
+		     latency_ms);
+		acs->latency_ms = latency_ms;
+		input_mix_disconnect(&acs->mix);
+	}
+
+	if ((from_source || relatch) && pw_stream_get_state(acs->pw.audio.stream, NULL) != PW_STREAM_STATE_UNCONNECTED) {
+		pw_stream_disconnect(acs->pw.audio.stream);
+		acs->connected_serial = SPA_ID_INVALID;
+	}
+
 	if ((acs->default_info.autoconnect = new_node_serial == PW_ID_ANY)) {
 		if (acs->default_info.node_serial != SPA_ID_INVALID) {
 			start_streaming(acs, get_node_by_serial(acs, acs->default_info.node_serial));
@@ -690,31 +1203,78 @@ static void catpion_update(void *data, obs_data_t *settings)
 	pw_thread_loop_unlock(acs->pw.thread_loop);
 
 	tp_update(&acs->text_src, settings);
+	update_line_metrics(acs);
+	update_input_mix(acs, settings);
+	/* sessions for a new model or channel split, and the outputs */
+	queue_reconfigure(acs);
+}
+
+static void tp_hide(struct tp_source *src)
+{
+	tp_thread_park(src, true);
+
+	/* nothing is drawn while hidden, a fresh texture comes with show */
+	if (src->textures) {
+		free_texture(src->textures);
+		src->textures = NULL;
+	}
+	pthread_mutex_lock(&src->tex_mutex);
+	if (src->tex_new) {
+		free_texture(src->tex_new);
+		src->tex_new = NULL;
+	}
+	pthread_mutex_unlock(&src->tex_mutex);
 }
 
 static void catpion_show(void *data)
 {
 	struct obs_audio_caption_src *acs = data;
 
-	pw_thread_loop_lock(acs->pw.thread_loop);
-	pw_stream_set_active(acs->pw.audio.stream, true);
-	pw_thread_loop_unlock(acs->pw.thread_loop);
+	os_atomic_set_bool(&acs->showing, true);
+	tp_thread_park(&acs->text_src, false);
+	queue_reconfigure(acs);
 }
 
 static void catpion_hide(void *data)
 {
 	struct obs_audio_caption_src *acs = data;
-	pw_thread_loop_lock(acs->pw.thread_loop);
-	pw_stream_set_active(acs->pw.audio.stream, false);
-	pw_thread_loop_unlock(acs->pw.thread_loop);
+
+	os_atomic_set_bool(&acs->showing, false);
+	tp_hide(&acs->text_src);
+	queue_reconfigure(acs);
+}
+
+/* Sources on the program output get their text drawn first */
+static void catpion_activate(void *data)
+{
+	struct obs_audio_caption_src *acs = data;
+	tp_thread_set_live(&acs->text_src, true);
+}
+
+static void catpion_deactivate(void *data)
+{
+	struct obs_audio_caption_src *acs = data;
+	tp_thread_set_live(&acs->text_src, false);
 }
 
 static void catpion_destroy(void *data)
 {
 	struct obs_audio_caption_src *acs = data;
 
+	/* mirrors stop getting text before anything goes away */
+	tp_clear_mirrors(&acs->text_src);
+	/* the capture callback feeds the session */
+	source_capture_destroy(&acs->capture);
+	channel_split_destroy(acs);
+	input_mix_destroy(acs);
+
 	pw_thread_loop_lock(acs->pw.thread_loop);
 
+	osc_control_stop(&acs->control);
+
+	/* no failing over while the nodes are torn down */
+	bfree(acs->fallbacks);
+	acs->fallbacks = NULL;
 	obs_pw_audio_proxy_list_clear(&acs->targets);
 
 	if (acs->default_info.metadata.proxy) {
@@ -739,14 +1299,17 @@ static void catpion_destroy(void *data)
 	pthread_mutex_destroy(&acs->text_src.config_mutex);
 
 	release_session(acs);
+	line_generator_destroy(&acs->lg);
+	text_font_cache_release(acs->font_cache);
+	caption_fanout_destroy(&acs->fanout);
+	caption_outputs_destroy(&acs->outputs);
+	caption_shm_destroy(&acs->shm);
+	pthread_mutex_destroy(&acs->lg_mutex);
 	bfree(acs);
 }
 
-static uint32_t caption_get_width(void *data)
+static uint32_t tp_get_width(struct tp_source *src)
 {
-	struct obs_audio_caption_src *acs = data;
-	struct tp_source *src = &acs->text_src;
-
 	uint32_t w = 0;
 	struct tp_texture *t = src->textures;
 	while (t) {
@@ -758,11 +1321,8 @@ static uint32_t caption_get_width(void *data)
 	return w;
 }
 
-static uint32_t caption_get_height(void *data)
+static uint32_t tp_get_height(struct tp_source *src)
 {
-	struct obs_audio_caption_src *acs = data;
-	struct tp_source *src = &acs->text_src;
-
 	uint32_t h = 0;
 	struct tp_texture *t = src->textures;
 	while (t) {
@@ -774,6 +1334,18 @@ static uint32_t caption_get_height(void *data)
 	return h;
 }
 
+static uint32_t caption_get_width(void *data)
+{
+	struct obs_audio_caption_src *acs = data;
+	return tp_get_width(&acs->text_src);
+}
+
+static uint32_t caption_get_height(void *data)
+{
+	struct obs_audio_caption_src *acs = data;
+	return tp_get_height(&acs->text_src);
+}
+
 static void tp_surface_to_texture(struct tp_texture *t)
 {
 	if (t->surface && !t->tex) {
@@ -782,11 +1354,8 @@ static void tp_surface_to_texture(struct tp_texture *t)
 	}
 }
 
-static void caption_render(void *data, gs_effect_t *effect)
+static void tp_render(struct tp_source *src)
 {
-	UNUSED_PARAMETER(effect);
-	struct obs_audio_caption_src *acs = data;
-	struct tp_source *src = &acs->text_src;
 	if (!textalpha_effect)
 		return;
 
@@ -794,8 +1363,8 @@ static void caption_render(void *data, gs_effect_t *effect)
 	gs_blend_state_push();
 	gs_blend_function(GS_BLEND_ONE, GS_BLEND_INVSRCALPHA);
 
-	const int w = caption_get_width(data);
-	const int h = caption_get_height(data);
+	const int w = tp_get_width(src);
+	const int h = tp_get_height(src);
 	int xoff = 0, yoff = 0;
 
 	for (struct tp_texture *t = src->textures; t; t = t->next) {
@@ -814,6 +1383,13 @@ static void caption_render(void *data, gs_effect_t *effect)
 	obs_leave_graphics();
 }
 
+static void caption_render(void *data, gs_effect_t *effect)
+{
+	UNUSED_PARAMETER(effect);
+	struct obs_audio_caption_src *acs = data;
+	tp_render(&acs->text_src);
+}
+
 static inline void tp_load_new_texture(struct tp_source *src, uint64_t lastframe_ns)
 {
 	if (src->tex_new) {
@@ -862,11 +1438,8 @@ static struct tp_texture *tp_pop_old_textures(struct tp_texture *t, uint64_t now
 	return t;
 }
 
-static void caption_tick(void *data, float seconds)
+static void tp_tick(struct tp_source *src, float seconds)
 {
-	struct obs_audio_caption_src *acs = data;
-	struct tp_source *src = &acs->text_src;
-
 	uint64_t now_ns = os_gettime_ns();
 	uint64_t lastframe_ns = now_ns - (uint64_t)(seconds * 1e9);
 
@@ -885,6 +1458,22 @@ static void caption_tick(void *data, float seconds)
 	src->textures = tp_pop_old_textures(src->textures, now_ns, src);
 }
 
+static void caption_tick(void *data, float seconds)
+{
+	struct obs_audio_caption_src *acs = data;
+
+	tp_tick(&acs->text_src, seconds);
+	source_capture_tick(&acs->capture);
+
+	long failover_ns = os_atomic_load_long(&acs->failover_start_ns);
+	long first_audio_ns = os_atomic_load_long(&acs->pw.audio.first_audio_ns);
+	if (failover_ns && first_audio_ns >= failover_ns) {
+		os_atomic_set_long(&acs->failover_start_ns, 0);
+		blog(LOG_INFO, "[catpion] %s: audio back %.2f ms after failing over", obs_source_get_name(acs->source),
+		     (first_audio_ns - failover_ns) / 1000000.0);
+	}
+}
+
 const struct obs_source_info catpion_audio_input = {
 	.id = "catpion_audio_input",
 	.type = OBS_SOURCE_TYPE_INPUT,
@@ -900,10 +1489,320 @@ const struct obs_source_info catpion_audio_input = {
 	.video_tick = caption_tick,
 	.show = catpion_show,
 	.hide = catpion_hide,
+	.activate = catpion_activate,
+	.deactivate = catpion_deactivate,
 	.destroy = catpion_destroy,
 	.icon_type = OBS_ICON_TYPE_TEXT,
 };
 
+const struct obs_source_info catpion_audio_output = {
+	.id = "catpion_audio_output",
+	.type = OBS_SOURCE_TYPE_INPUT,
+	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW | OBS_SOURCE_DO_NOT_DUPLICATE,
+	.get_name = catpion_audio_output_name,
+	.create = catpion_audio_output_create,
+	.get_defaults = catpion_defaults,
+	.get_properties = catpion_properties,
+	.update = catpion_update,
+	.get_width = caption_get_width,
+	.get_height = caption_get_height,
+	.video_render = caption_render,
+	.video_tick = caption_tick,
+	.show = catpion_show,
+	.hide = catpion_hide,
+	.activate = catpion_activate,
+	.deactivate = catpion_deactivate,
+	.destroy = catpion_destroy,
+	.icon_type = OBS_ICON_TYPE_TEXT,
+};
+
+/* A caption source showing the text of another one in its own style,
+ * without a recognizer or audio of its own */
+struct caption_mirror {
+	obs_source_t *source;
+
+	struct tp_source text_src;
+
+	/* guards the target between update and tick */
+	pthread_mutex_t mutex;
+	char *target_name;
+	obs_weak_source_t *target;
+	/* the target is kept captioning while the mirror is shown */
+	bool holding;
+	uint64_t next_lookup_ns;
+
+	volatile bool showing;
+};
+
+#define MIRROR_LOOKUP_INTERVAL_NS 2000000000ULL
+
+static bool is_catpion_source(obs_source_t *source)
+{
+	const char *id = obs_source_get_unversioned_id(source);
+	return id && (strcmp(id, catpion_audio_input.id) == 0 || strcmp(id, catpion_audio_output.id) == 0);
+}
+
+/* Called with the mirror's mutex held */
+static void mirror_hold(struct caption_mirror *m, bool hold)
+{
+	if (m->holding == hold)
+		return;
+
+	obs_source_t *target = obs_weak_source_get_source(m->target);
+	if (!target) {
+		/* a destroyed target has nothing left to hold */
+		if (!hold)
+			m->holding = false;
+		return;
+	}
+
+	struct obs_audio_caption_src *acs = obs_obj_get_data(target);
+	if (hold)
+		os_atomic_inc_long(&acs->mirror_holds);
+	else
+		os_atomic_dec_long(&acs->mirror_holds);
+	m->holding = hold;
+	queue_reconfigure(acs);
+	obs_source_release(target);
+}
+
+/* Called with the mirror's mutex held */
+static void mirror_detach(struct caption_mirror *m)
+{
+	mirror_hold(m, false);
+	tp_set_mirror(&m->text_src, NULL);
+	obs_weak_source_release(m->target);
+	m->target = NULL;
+	m->holding = false;
+	m->next_lookup_ns = 0;
+}
+
+/* Called with the mirror's mutex held */
+static void mirror_attach(struct caption_mirror *m)
+{
+	if (!m->target_name || !*m->target_name)
+		return;
+
+	obs_source_t *target = obs_get_source_by_name(m->target_name);
+	if (!target)
+		return;
+
+	if (is_catpion_source(target)) {
+		struct obs_audio_caption_src *acs = obs_obj_get_data(target);
+		tp_set_mirror(&m->text_src, &acs->text_src);
+		m->target = obs_source_get_weak_source(target);
+		blog(LOG_INFO, "[catpion] %s: mirroring %s", obs_source_get_name(m->source), m->target_name);
+	} else {
+		blog(LOG_WARNING, "[catpion] %s: '%s' is not a caption source", obs_source_get_name(m->source),
+		     m->target_name);
+	}
+	obs_source_release(target);
+}
+
+static const char *mirror_name(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+	return obs_module_text("Catpion Mirror");
+}
+
+static void mirror_update(void *data, obs_data_t *settings)
+{
+	struct caption_mirror *m = data;
+
+	tp_update(&m->text_src, settings);
+
+	pthread_mutex_lock(&m->mutex);
+	const char *target_name = obs_data_get_string(settings, "mirror_of");
+	if (!m->target_name || strcmp(m->target_name, target_name) != 0) {
+		mirror_detach(m);
+		bfree(m->target_name);
+		m->target_name = bstrdup(target_name);
+	} else if (m->target) {
+		/* tp_update put the placeholder text back, fetch the target's again */
+		obs_source_t *target = obs_weak_source_get_source(m->target);
+		if (target) {
+			struct obs_audio_caption_src *acs = obs_obj_get_data(target);
+			tp_set_mirror(&m->text_src, &acs->text_src);
+			obs_source_release(target);
+		}
+	}
+	pthread_mutex_unlock(&m->mutex);
+}
+
+static void *mirror_create(obs_data_t *settings, obs_source_t *source)
+{
+	struct caption_mirror *m = bzalloc(sizeof(struct caption_mirror));
+	m->source = source;
+
+	if (!os_atomic_exchange_bool(&effect_queued, true)) {
+		obs_queue_task(OBS_TASK_GRAPHICS, load_effect_task, NULL, false);
+	}
+
+	pthread_mutex_init(&m->text_src.config_mutex, NULL);
+	pthread_mutex_init(&m->text_src.tex_mutex, NULL);
+	pthread_mutex_init(&m->mutex, NULL);
+
+	mirror_update(m, settings);
+
+	tp_thread_start(&m->text_src);
+
+	return m;
+}
+
+static void mirror_destroy(void *data)
+{
+	struct caption_mirror *m = data;
+
+	pthread_mutex_lock(&m->mutex);
+	mirror_detach(m);
+	pthread_mutex_unlock(&m->mutex);
+	bfree(m->target_name);
+
+	tp_thread_end(&m->text_src);
+
+	tp_config_destroy_member(&m->text_src.config);
+
+	if (m->text_src.textures)
+		free_texture(m->text_src.textures);
+	if (m->text_src.tex_new)
+		free_texture(m->text_src.tex_new);
+
+	pthread_mutex_destroy(&m->text_src.tex_mutex);
+	pthread_mutex_destroy(&m->text_src.config_mutex);
+	pthread_mutex_destroy(&m->mutex);
+	bfree(m);
+}
+
+static void mirror_show(void *data)
+{
+	struct caption_mirror *m = data;
+
+	os_atomic_set_bool(&m->showing, true);
+	tp_thread_park(&m->text_src, false);
+}
+
+static void mirror_hide(void *data)
+{
+	struct caption_mirror *m = data;
+
+	os_atomic_set_bool(&m->showing, false);
+	tp_hide(&m->text_src);
+}
+
+static void mirror_activate(void *data)
+{
+	struct caption_mirror *m = data;
+	tp_thread_set_live(&m->text_src, true);
+}
+
+static void mirror_deactivate(void *data)
+{
+	struct caption_mirror *m = data;
+	tp_thread_set_live(&m->text_src, false);
+}
+
+static uint32_t mirror_get_width(void *data)
+{
+	struct caption_mirror *m = data;
+	return tp_get_width(&m->text_src);
+}
+
+static uint32_t mirror_get_height(void *data)
+{
+	struct caption_mirror *m = data;
+	return tp_get_height(&m->text_src);
+}
+
+static void mirror_render(void *data, gs_effect_t *effect)
+{
+	UNUSED_PARAMETER(effect);
+	struct caption_mirror *m = data;
+	tp_render(&m->text_src);
+}
+
+static void mirror_tick(void *data, float seconds)
+{
+	struct caption_mirror *m = data;
+
+	tp_tick(&m->text_src, seconds);
+
+	if (pthread_mutex_trylock(&m->mutex) != 0)
+		return;
+
+	/* the target was removed or renamed, look for it again now and then */
+	if (m->target && !tp_is_mirroring(&m->text_src)) {
+		mirror_detach(m);
+	}
+	uint64_t now_ns = os_gettime_ns();
+	if (!m->target && now_ns >= m->next_lookup_ns) {
+		m->next_lookup_ns = now_ns + MIRROR_LOOKUP_INTERVAL_NS;
+		mirror_attach(m);
+	}
+
+	if (m->target)
+		mirror_hold(m, os_atomic_load_bool(&m->showing));
+
+	pthread_mutex_unlock(&m->mutex);
+}
+
+static bool add_catpion_source_name(void *data, obs_source_t *source)
+{
+	obs_property_t *list = data;
+	if (is_catpion_source(source)) {
+		const char *name = obs_source_get_name(source);
+		obs_property_list_add_string(list, name, name);
+	}
+	return true;
+}
+
+static obs_properties_t *mirror_properties(void *data)
+{
+	struct caption_mirror *m = data;
+	obs_properties_t *props = obs_properties_create();
+
+	obs_property_t *prop = obs_properties_add_list(props, "mirror_of", obs_module_text("Show captions of"),
+						       OBS_COMBO_TYPE_EDITABLE, OBS_COMBO_FORMAT_STRING);
+	obs_property_set_long_description(
+		prop, obs_module_text("Another caption source, shown here in this source's style without "
+				      "recognizing the audio twice"));
+	obs_enum_sources(add_catpion_source_name, prop);
+
+	tp_add_text_properties(props);
+	tp_add_effect_properties(props);
+
+	if (m)
+		tp_add_render_info(props, &m->text_src);
+
+	return props;
+}
+
+static void mirror_defaults(obs_data_t *settings)
+{
+	tp_defaults(settings);
+	obs_data_set_default_string(settings, "mirror_of", "");
+}
+
+const struct obs_source_info catpion_mirror = {
+	.id = "catpion_mirror",
+	.type = OBS_SOURCE_TYPE_INPUT,
+	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW | OBS_SOURCE_DO_NOT_DUPLICATE,
+	.get_name = mirror_name,
+	.create = mirror_create,
+	.get_defaults = mirror_defaults,
+	.get_properties = mirror_properties,
+	.update = mirror_update,
+	.get_width = mirror_get_width,
+	.get_height = mirror_get_height,
+	.video_render = mirror_render,
+	.video_tick = mirror_tick,
+	.show = mirror_show,
+	.hide = mirror_hide,
+	.activate = mirror_activate,
+	.deactivate = mirror_deactivate,
+	.destroy = mirror_destroy,
+	.icon_type = OBS_ICON_TYPE_TEXT,
+};
+
 bool obs_module_load(void)
 {
 	pw_init(NULL, NULL);
@@ -911,13 +1810,23 @@ bool obs_module_load(void)
     aam_api_init(APRIL_VERSION);
 	InitCatpionUI();
 
+	config_queue = os_task_queue_create();
+	caption_outputs_module_load();
+
 	obs_register_source(&catpion_audio_input);
+	obs_register_source(&catpion_audio_output);
+	obs_register_source(&catpion_mirror);
 
 	return true;
 }
 
 void obs_module_unload(void)
 {
+	os_task_queue_destroy(config_queue);
+	config_queue = NULL;
+	caption_outputs_module_unload();
+	SessionPoolDestroy();
+
 #if PW_CHECK_VERSION(0, 3, 49)
 	pw_deinit();
 #endif
@@ -8,6 +8,12 @@
 #include "pipewire-audio.h"
 #include "obs-text-pthread.h"
 #include "line-gen.h"
+#include "caption-fanout.h"
+#include "caption-shm.h"
+#include "osc-control.h"
+#include "source-capture.h"
+#include "channel-split.h"
+#include "input-mix.h"
 
 struct obs_audio_caption_src {
 	obs_source_t *source;
@@ -24,14 +30,57 @@ struct obs_audio_caption_src {
 	} default_info;
 
 	struct obs_pw_audio_proxy_list targets;
+	/* targets are sinks captured through their monitor */
+	bool capture_sink;
 
 	struct dstr target_name;
 	uint32_t connected_serial;
+	/* requested node latency of every stream, 0 for the graph's */
+	uint32_t latency_ms;
+	/* devices to switch to when the connected one disappears, one per line
+	 * in order, guarded by the thread loop lock */
+	char *fallbacks;
+	bool on_fallback;
+	/* when the last failover started, cleared once its audio arrives */
+	volatile long failover_start_ns;
 
     size_t model_id;
     size_t model_sample_rate;
     AprilASRSession session;
+	/* owner of session, returned to the model's pool when done */
+	struct pooled_session *pooled;
     struct line_generator lg;
+	/* guards lg between the result handler and remote commands */
+	pthread_mutex_t lg_mutex;
+	/* glyph advances for the font lg breaks lines with */
+	struct text_font_cache *font_cache;
+
+	/* hidden sources drop their session unless keep_hidden is set */
+	volatile bool showing;
+	volatile bool keep_hidden;
+	/* shown mirror sources keep the source captioning */
+	volatile long mirror_holds;
+	bool idle;
+	/* set until the config queue first brings the source up */
+	uint64_t create_ns;
+
+	/* audio is not fed to the session while paused */
+	volatile bool paused;
+	bool was_paused;
+
+	struct source_capture capture;
+	/* each channel of the device captioned on its own */
+	struct channel_split split;
+	bool split_enabled;
+	/* other devices summed with the main one */
+	struct input_mix mix;
+	/* mix_inputs is set but unused, logged once when that starts */
+	bool mix_ignored;
+	struct caption_fanout fanout;
+	struct caption_shm shm;
+	struct caption_outputs outputs;
+	struct osc_control control;
 };
 
 void InitCatpionUI();
+void CatpionLoadModel(const char *path);
@@ -0,0 +1,270 @@
+/* channel-split.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "channel-split.h"
+
+#include <obs-module.h>
+#include <util/dstr.h>
+
+#include <string.h>
+
+#include "catpion.h"
+
+#define LABEL_SEPARATOR ": "
+
+/* Combine the channels' current lines, called with lg_mutex held */
+static void channel_split_show(struct obs_audio_caption_src *acs)
+{
+	struct channel_split *split = &acs->split;
+
+	uint64_t hash = TEXT_HASH_INIT;
+	size_t size = 1;
+	for (size_t i = 0; i < split->num_channels; i++) {
+		size_t len;
+		const char *line = line_generator_current_line(&split->channels[i].lg, &len);
+		hash = text_hash_update(hash, line, len);
+		hash = text_hash_update(hash, "\n", 1);
+		size += strlen(split->channels[i].label) + sizeof(LABEL_SEPARATOR) + len;
+	}
+	if (split->has_hash && split->hash == hash)
+		return;
+	split->has_hash = true;
+	split->hash = hash;
+
+	struct text_snapshot *output = text_snapshot_alloc(size);
+	char *head = output->text;
+	for (size_t i = 0; i < split->num_channels; i++) {
+		size_t len;
+		const char *line = line_generator_current_line(&split->channels[i].lg, &len);
+		/* quiet speakers take no row */
+		if (!len)
+			continue;
+		if (head != output->text)
+			*head++ = '\n';
+		size_t label_len = strlen(split->channels[i].label);
+		memcpy(head, split->channels[i].label, label_len);
+		head += label_len;
+		memcpy(head, LABEL_SEPARATOR, sizeof(LABEL_SEPARATOR) - 1);
+		head += sizeof(LABEL_SEPARATOR) - 1;
+		memcpy(head, line, len);
+		head += len;
+	}
+	*head = '\0';
+	output->len = head - output->text;
+
+	tp_edit_text(&acs->text_src, output);
+	text_snapshot_release(output);
+}
+
+static void channel_handler(void *data, AprilResultType result, size_t count, const AprilToken *tokens)
+{
+	struct caption_channel *ch = data;
+	struct obs_audio_caption_src *acs = ch->acs;
+
+	pthread_mutex_lock(&acs->lg_mutex);
+
+	switch (result) {
+	case APRIL_RESULT_RECOGNITION_PARTIAL:
+	case APRIL_RESULT_RECOGNITION_FINAL:
+		line_generator_update(&ch->lg, count, tokens);
+		if (result == APRIL_RESULT_RECOGNITION_FINAL)
+			line_generator_finalize(&ch->lg);
+		break;
+
+	case APRIL_RESULT_SILENCE:
+		line_generator_break(&ch->lg);
+		break;
+
+	default:
+		break;
+	}
+	channel_split_show(acs);
+
+	pthread_mutex_unlock(&acs->lg_mutex);
+}
+
+struct channel_swap {
+	struct channel_split *split;
+	struct caption_channel *channels;
+	size_t num_channels;
+	short *planes;
+};
+
+static int channel_swap_invoke(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size,
+			       void *user_data)
+{
+	UNUSED_PARAMETER(loop);
+	UNUSED_PARAMETER(async);
+	UNUSED_PARAMETER(seq);
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(size);
+
+	struct channel_swap *swap = user_data;
+	struct caption_channel *channels = swap->split->channels;
+	size_t num_channels = swap->split->num_channels;
+	short *planes = swap->split->planes;
+
+	swap->split->channels = swap->channels;
+	swap->split->num_channels = swap->num_channels;
+	swap->split->planes = swap->planes;
+
+	swap->channels = channels;
+	swap->num_channels = num_channels;
+	swap->planes = planes;
+	return 0;
+}
+
+static char *channel_label(const char *labels, size_t index)
+{
+	const char *p = labels ? labels : "";
+	for (size_t i = 0; i < index && *p; i++) {
+		p += strcspn(p, "\n");
+		if (*p)
+			p++;
+	}
+
+	size_t len = strcspn(p, "\r\n");
+	if (len)
+		return bstrdup_n(p, len);
+
+	struct dstr label = {0};
+	dstr_printf(&label, "%s %zu", obs_module_text("Channel"), index + 1);
+	return label.array;
+}
+
+void channel_split_configure(struct obs_audio_caption_src *acs, size_t num_channels, const char *labels)
+{
+	struct channel_split *split = &acs->split;
+	size_t model_id = ModelCurID();
+
+	if (num_channels > CHANNEL_SPLIT_MAX)
+		num_channels = CHANNEL_SPLIT_MAX;
+	if (!labels)
+		labels = "";
+
+	if (num_channels == split->num_channels && (!num_channels || model_id == split->model_id) &&
+	    split->labels && strcmp(labels, split->labels) == 0)
+		return;
+
+	bfree(split->labels);
+	split->labels = bstrdup(labels);
+	split->model_id = model_id;
+
+	/* Sessions are created before the stream sees the new channels */
+	struct channel_swap swap = {.split = split};
+	if (num_channels) {
+		swap.channels = bzalloc(sizeof(struct caption_channel) * num_channels);
+		swap.num_channels = num_channels;
+		swap.planes = bzalloc(sizeof(short) * CHANNEL_SPLIT_FRAMES * num_channels);
+
+		for (size_t i = 0; i < num_channels; i++) {
+			struct caption_channel *ch = &swap.channels[i];
+			ch->acs = acs;
+			ch->label = channel_label(labels, i);
+			line_generator_set_layout(&ch->lg, 1, 0);
+			line_generator_init(&ch->lg);
+			ch->pooled = SessionAcquire(model_id, channel_handler, ch);
+		}
+		blog(LOG_INFO, "[catpion] %s: captioning %zu channels separately", obs_source_get_name(acs->source),
+		     num_channels);
+	}
+
+	pthread_mutex_lock(&acs->lg_mutex);
+	pw_data_loop_invoke(pw_context_get_data_loop(acs->pw.context), channel_swap_invoke, 0, NULL, 0, true, &swap);
+	split->has_hash = false;
+	if (split->num_channels)
+		channel_split_set_font(split, acs->lg.font, acs->lg.max_text_width);
+	pthread_mutex_unlock(&acs->lg_mutex);
+
+	/* swap now holds the channels that were replaced */
+	for (size_t i = 0; i < swap.num_channels; i++) {
+		SessionRelease(swap.channels[i].pooled);
+	}
+
+	pthread_mutex_lock(&acs->lg_mutex);
+	for (size_t i = 0; i < swap.num_channels; i++) {
+		line_generator_destroy(&swap.channels[i].lg);
+		bfree(swap.channels[i].label);
+	}
+	/* back to the single recognizer, which resends its lines */
+	if (!split->num_channels && swap.num_channels)
+		line_generator_set_label(&acs->lg, &acs->text_src);
+	pthread_mutex_unlock(&acs->lg_mutex);
+
+	bfree(swap.channels);
+	bfree(swap.planes);
+}
+
+void channel_split_set_font(struct channel_split *split, struct text_font_cache *font, int max_width)
+{
+	for (size_t i = 0; i < split->num_channels; i++) {
+		struct caption_channel *ch = &split->channels[i];
+		int width = max_width;
+		if (font) {
+			width -= (int)text_font_cache_width(font, ch->label);
+			width -= (int)text_font_cache_width(font, LABEL_SEPARATOR);
+		} else {
+			width -= (int)(strlen(ch->label) + sizeof(LABEL_SEPARATOR) - 1);
+		}
+		line_generator_set_font(&ch->lg, font, width > 1 ? width : 1);
+	}
+}
+
+void channel_split_feed(struct channel_split *split, const short *samples, uint32_t frames, uint32_t channels)
+{
+	size_t n = split->num_channels < channels ? split->num_channels : channels;
+
+	while (frames > 0) {
+		uint32_t chunk = frames < CHANNEL_SPLIT_FRAMES ? frames : CHANNEL_SPLIT_FRAMES;
+
+		/* one pass over the interleaved frames fills every plane */
+		for (uint32_t f = 0; f < chunk; f++) {
+			const short *frame = samples + (size_t)f * channels;
+			for (size_t c = 0; c < n; c++) {
+				split->planes[c * CHANNEL_SPLIT_FRAMES + f] = frame[c];
+			}
+		}
+
+		for (size_t c = 0; c < n; c++) {
+			struct pooled_session *ps = split->channels[c].pooled;
+			if (ps)
+				aas_feed_pcm16(ps->session, &split->planes[c * CHANNEL_SPLIT_FRAMES], chunk);
+		}
+
+		samples += (size_t)chunk * channels;
+		frames -= chunk;
+	}
+}
+
+void channel_split_flush(struct channel_split *split)
+{
+	for (size_t i = 0; i < split->num_channels; i++) {
+		struct pooled_session *ps = split->channels[i].pooled;
+		if (ps)
+			aas_flush(ps->session);
+	}
+}
+
+void channel_split_destroy(struct obs_audio_caption_src *acs)
+{
+	channel_split_configure(acs, 0, NULL);
+	bfree(acs->split.labels);
+	acs->split.labels = NULL;
+}
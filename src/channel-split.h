@@ -0,0 +1,93 @@
+/* channel-split.h
+ * Caption each channel of a multi-channel device with its own recognizer
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "line-gen.h"
+#include "model.h"
+
+#define CHANNEL_SPLIT_MAX 8
+/* Frames deinterleaved at a time */
+#define CHANNEL_SPLIT_FRAMES 2048
+
+struct obs_audio_caption_src;
+
+/**
+ * One channel of the device, with its own session and a single line
+ * shown after its speaker label
+ */
+struct caption_channel {
+	struct obs_audio_caption_src *acs;
+	struct pooled_session *pooled;
+	struct line_generator lg;
+	char *label;
+};
+
+/**
+ * Each process callback deinterleaves the stream once and feeds every
+ * channel's session. The channels' current lines are combined into
+ * "label: text" rows on the caption source.
+ */
+struct channel_split {
+	/* swapped on the data loop, guarded by lg_mutex elsewhere */
+	struct caption_channel *channels;
+	size_t num_channels;
+
+	/* data loop only */
+	short *planes;
+
+	/* what channels was built for, config queue */
+	size_t model_id;
+	char *labels;
+
+	/* guarded by lg_mutex */
+	bool has_hash;
+	uint64_t hash;
+};
+
+/**
+ * Caption num_channels channels, 0 stops splitting. labels has one label
+ * per line, missing ones are "Channel N".
+ * @warning Call from the config queue with the thread loop unlocked
+ */
+void channel_split_configure(struct obs_audio_caption_src *acs, size_t num_channels, const char *labels);
+void channel_split_destroy(struct obs_audio_caption_src *acs);
+
+/**
+ * Leave room for the labels in the width lines are broken at
+ * @warning Call with lg_mutex held
+ */
+void channel_split_set_font(struct channel_split *split, struct text_font_cache *font, int max_width);
+
+/**
+ * Feed interleaved audio, channels past the configured ones are dropped
+ * @warning Call from the stream's process callback
+ */
+void channel_split_feed(struct channel_split *split, const short *samples, uint32_t frames, uint32_t channels);
+
+/**
+ * @warning Call from the stream's process callback
+ */
+void channel_split_flush(struct channel_split *split);
@@ -0,0 +1,344 @@
+/* input-mix.c
+ * Mix several devices into one recognizer session
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "input-mix.h"
+
+#include <obs-module.h>
+#include <media-io/audio-math.h>
+#include <util/dstr.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "catpion.h"
+
+#define RING_MASK (INPUT_MIX_RING - 1)
+
+/* Downmix and scale to floats where 1.0 is full scale */
+static void mix_input_write(struct mix_input *in, const short *samples, uint32_t frames, uint32_t channels)
+{
+	const float scale = in->gain / (32768.0f * (float)channels);
+
+	while (frames > 0) {
+		size_t off = in->written & RING_MASK;
+		uint32_t n = frames < INPUT_MIX_RING - off ? frames : (uint32_t)(INPUT_MIX_RING - off);
+		float *restrict dst = in->ring + off;
+
+		if (channels == 1) {
+			for (uint32_t f = 0; f < n; f++) {
+				dst[f] = (float)samples[f] * scale;
+			}
+		} else {
+			for (uint32_t f = 0; f < n; f++) {
+				int32_t sum = 0;
+				for (uint32_t c = 0; c < channels; c++) {
+					sum += samples[f * channels + c];
+				}
+				dst[f] = (float)sum * scale;
+			}
+		}
+
+		samples += (size_t)n * channels;
+		frames -= n;
+		in->written += n;
+	}
+}
+
+static void mix_input_pad(struct mix_input *in, uint64_t until)
+{
+	while (in->written < until) {
+		size_t off = in->written & RING_MASK;
+		uint64_t n = until - in->written;
+		if (n > INPUT_MIX_RING - off)
+			n = INPUT_MIX_RING - off;
+		memset(in->ring + off, 0, n * sizeof(float));
+		in->written += n;
+	}
+}
+
+/* Feed the frames every input has written */
+static void mix_run(struct input_mix *mix, AprilASRSession session)
+{
+	uint64_t ready = mix->inputs[0].written;
+	for (size_t i = 1; i < mix->num_inputs; i++) {
+		if (mix->inputs[i].written < ready)
+			ready = mix->inputs[i].written;
+	}
+
+	while (mix->mixed < ready) {
+		size_t off = mix->mixed & RING_MASK;
+		uint64_t n = ready - mix->mixed;
+		if (n > INPUT_MIX_CHUNK)
+			n = INPUT_MIX_CHUNK;
+		if (n > INPUT_MIX_RING - off)
+			n = INPUT_MIX_RING - off;
+
+		/* plain loops over contiguous floats, left for the compiler to vectorize */
+		float *restrict acc = mix->acc;
+		memcpy(acc, mix->inputs[0].ring + off, n * sizeof(float));
+		for (size_t i = 1; i < mix->num_inputs; i++) {
+			const float *restrict src = mix->inputs[i].ring + off;
+			for (size_t f = 0; f < n; f++) {
+				acc[f] += src[f];
+			}
+		}
+
+		/* Cubic soft clip, close to unity when quiet and reaching full
+		 * scale smoothly at 1.5, so summed loud speakers don't wrap */
+		short *restrict out = mix->out;
+		for (size_t f = 0; f < n; f++) {
+			float x = fminf(fmaxf(acc[f], -1.5f), 1.5f);
+			out[f] = (short)((x - (4.0f / 27.0f) * x * x * x) * 32767.0f);
+		}
+
+		if (session)
+			aas_feed_pcm16(session, mix->out, (size_t)n);
+		mix->mixed += n;
+	}
+}
+
+void input_mix_push(struct input_mix *mix, size_t index, const short *samples, uint32_t frames, uint32_t channels,
+		    AprilASRSession session)
+{
+	if (index >= mix->num_inputs)
+		return;
+
+	struct mix_input *in = &mix->inputs[index];
+	if (!channels)
+		channels = 1;
+
+	while (frames > 0) {
+		uint32_t chunk = frames < INPUT_MIX_CHUNK ? frames : INPUT_MIX_CHUNK;
+		mix_input_write(in, samples, chunk, channels);
+
+		/* stop waiting for inputs that fell too far behind */
+		if (in->written - mix->mixed > INPUT_MIX_MAX_LAG) {
+			for (size_t i = 0; i < mix->num_inputs; i++) {
+				if (mix->inputs[i].written < in->written) {
+					mix->padded += in->written - mix->inputs[i].written;
+					mix_input_pad(&mix->inputs[i], in->written);
+				}
+			}
+		}
+
+		mix_run(mix, session);
+
+		samples += (size_t)chunk * channels;
+		frames -= chunk;
+	}
+}
+
+struct mix_swap {
+	struct input_mix *mix;
+	struct mix_input *inputs;
+	size_t num_inputs;
+	uint64_t padded;
+};
+
+static int mix_swap_invoke(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size,
+			   void *user_data)
+{
+	UNUSED_PARAMETER(loop);
+	UNUSED_PARAMETER(async);
+	UNUSED_PARAMETER(seq);
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(size);
+
+	struct mix_swap *swap = user_data;
+	struct mix_input *inputs = swap->mix->inputs;
+	size_t num_inputs = swap->mix->num_inputs;
+
+	swap->mix->inputs = swap->inputs;
+	swap->mix->num_inputs = swap->num_inputs;
+
+	swap->inputs = inputs;
+	swap->num_inputs = num_inputs;
+	swap->padded = swap->mix->padded;
+
+	swap->mix->mixed = 0;
+	swap->mix->padded = 0;
+	return 0;
+}
+
+/* One device per line, "name" or "name @ gain dB" */
+static size_t parse_inputs(const char *config, char **names, float *gains)
+{
+	size_t count = 0;
+	const char *p = config;
+
+	while (*p && count < INPUT_MIX_MAX - 1) {
+		size_t len = strcspn(p, "\r\n");
+		char *line = bstrdup_n(p, len);
+		float gain = 1.0f;
+
+		char *at = strrchr(line, '@');
+		if (at) {
+			*at = '\0';
+			gain = db_to_mul((float)strtod(at + 1, NULL));
+		}
+
+		char *name = strdepad(line);
+		if (*name) {
+			names[count] = bstrdup(name);
+			gains[count] = gain;
+			count++;
+		}
+		bfree(line);
+
+		p += len;
+		while (*p == '\r' || *p == '\n')
+			p++;
+	}
+	return count;
+}
+
+void input_mix_configure(struct obs_audio_caption_src *acs, const char *inputs, double main_gain_db)
+{
+	struct input_mix *mix = &acs->mix;
+
+	if (!inputs)
+		inputs = "";
+	if (mix->config && strcmp(inputs, mix->config) == 0 && main_gain_db == mix->main_gain_db)
+		return;
+
+	bfree(mix->config);
+	mix->config = bstrdup(inputs);
+	mix->main_gain_db = main_gain_db;
+
+	char *names[INPUT_MIX_MAX - 1];
+	float gains[INPUT_MIX_MAX - 1];
+	size_t count = parse_inputs(inputs, names, gains);
+
+	struct mix_swap swap = {.mix = mix};
+	if (count) {
+		swap.num_inputs = count + 1;
+		swap.inputs = bzalloc(sizeof(struct mix_input) * swap.num_inputs);
+		swap.inputs[0].gain = db_to_mul((float)main_gain_db);
+		for (size_t i = 0; i < count; i++) {
+			swap.inputs[i + 1].gain = gains[i];
+		}
+	}
+
+	pw_thread_loop_lock(acs->pw.thread_loop);
+
+	/* the old streams' inputs go away with the swap */
+	for (size_t i = 0; i < mix->num_streams; i++) {
+		obs_pw_audio_stream_destroy(&mix->streams[i].audio);
+		bfree(mix->streams[i].name);
+	}
+	bfree(mix->streams);
+	mix->streams = NULL;
+	mix->num_streams = 0;
+
+	pw_data_loop_invoke(pw_context_get_data_loop(acs->pw.context), mix_swap_invoke, 0, NULL, 0, true, &swap);
+
+	if (count) {
+		mix->streams = bzalloc(sizeof(struct mix_stream) * count);
+		for (size_t i = 0; i < count; i++) {
+			struct mix_stream *st = &mix->streams[i];
+			st->name = names[i];
+			st->serial = SPA_ID_INVALID;
+			/* left unconnected on failure, its input is padded with silence */
+			obs_pw_audio_stream_init(&st->audio, acs->pw.core, acs->capture_sink, true, acs);
+			st->audio.mix_index = i + 1;
+		}
+		mix->num_streams = count;
+	}
+
+	pw_thread_loop_unlock(acs->pw.thread_loop);
+
+	if (swap.num_inputs) {
+		blog(LOG_INFO, "[catpion] %s: stopped mixing %zu devices, %llu frames of late ones filled with silence",
+		     obs_source_get_name(acs->source), swap.num_inputs, (unsigned long long)swap.padded);
+	}
+	if (count) {
+		blog(LOG_INFO, "[catpion] %s: mixing %zu devices into one session", obs_source_get_name(acs->source),
+		     count + 1);
+	}
+	bfree(swap.inputs);
+}
+
+void input_mix_destroy(struct obs_audio_caption_src *acs)
+{
+	input_mix_configure(acs, NULL, 0.0);
+	bfree(acs->mix.config);
+	acs->mix.config = NULL;
+}
+
+void input_mix_node_added(struct obs_audio_caption_src *acs, const char *name, const char *friendly_name,
+			  uint32_t serial, uint32_t channels)
+{
+	struct input_mix *mix = &acs->mix;
+
+	if (!channels || !acs->model_sample_rate)
+		return;
+
+	for (size_t i = 0; i < mix->num_streams; i++) {
+		struct mix_stream *st = &mix->streams[i];
+		if (!st->audio.stream || st->serial != SPA_ID_INVALID)
+			continue;
+		if (strcmp(st->name, name) != 0 && (!friendly_name || strcmp(st->name, friendly_name) != 0))
+			continue;
+
+		if (obs_pw_audio_stream_connect(&st->audio, serial, channels, acs->model_sample_rate, acs->latency_ms) == 0) {
+			st->serial = serial;
+			pw_stream_set_active(st->audio.stream, !acs->idle);
+			blog(LOG_INFO, "[catpion] %p mixing in %u", st->audio.stream, serial);
+		} else {
+			blog(LOG_WARNING, "[catpion] Error connecting stream %p", st->audio.stream);
+		}
+	}
+}
+
+static void mix_stream_disconnect(struct mix_stream *st)
+{
+	if (pw_stream_get_state(st->audio.stream, NULL) != PW_STREAM_STATE_UNCONNECTED) {
+		pw_stream_disconnect(st->audio.stream);
+	}
+	st->serial = SPA_ID_INVALID;
+}
+
+void input_mix_node_removed(struct obs_audio_caption_src *acs, uint32_t serial)
+{
+	struct input_mix *mix = &acs->mix;
+
+	for (size_t i = 0; i < mix->num_streams; i++) {
+		if (mix->streams[i].serial == serial)
+			mix_stream_disconnect(&mix->streams[i]);
+	}
+}
+
+void input_mix_disconnect(struct input_mix *mix)
+{
+	for (size_t i = 0; i < mix->num_streams; i++) {
+		if (mix->streams[i].serial != SPA_ID_INVALID)
+			mix_stream_disconnect(&mix->streams[i]);
+	}
+}
+
+void input_mix_set_active(struct input_mix *mix, bool active)
+{
+	for (size_t i = 0; i < mix->num_streams; i++) {
+		struct mix_stream *st = &mix->streams[i];
+		if (st->serial != SPA_ID_INVALID)
+			pw_stream_set_active(st->audio.stream, active);
+	}
+}
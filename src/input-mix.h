@@ -0,0 +1,126 @@
+/* input-mix.h
+ * Mix several devices into one recognizer session
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <april_api.h>
+
+#include "pipewire-audio.h"
+
+/* The main device and up to 7 more */
+#define INPUT_MIX_MAX 8
+/* Frames kept per input, a power of two */
+#define INPUT_MIX_RING 8192
+/* An input this far ahead stops waiting for the others, which are
+ * filled with silence, e.g. an unplugged mic */
+#define INPUT_MIX_MAX_LAG 2048
+/* Frames mixed at a time */
+#define INPUT_MIX_CHUNK 1024
+
+struct obs_audio_caption_src;
+
+/**
+ * Mono audio of one input with its gain applied, data loop only
+ */
+struct mix_input {
+	float gain;
+	/* frames written since the mix was configured */
+	uint64_t written;
+	float ring[INPUT_MIX_RING];
+};
+
+/**
+ * Stream capturing one of the extra devices
+ */
+struct mix_stream {
+	struct obs_pw_audio_stream audio;
+	char *name;
+	/* node the stream is connected to, SPA_ID_INVALID while it's missing */
+	uint32_t serial;
+};
+
+/**
+ * Every stream of the source writes its audio into its input, and
+ * whatever all inputs have is summed, soft limited and fed to the single
+ * session. Input 0 is the main device.
+ */
+struct input_mix {
+	/* swapped on the data loop */
+	struct mix_input *inputs;
+	size_t num_inputs;
+
+	/* data loop only */
+	uint64_t mixed;
+	uint64_t padded;
+	float acc[INPUT_MIX_CHUNK];
+	short out[INPUT_MIX_CHUNK];
+
+	/* the extra devices' streams, guarded by the thread loop lock */
+	struct mix_stream *streams;
+	size_t num_streams;
+
+	/* what inputs was built for, UI thread */
+	char *config;
+	double main_gain_db;
+};
+
+/**
+ * Mix the devices in inputs with the main one, one per line as
+ * "name" or "name @ gain dB". NULL or empty stops mixing.
+ * @warning Call from the UI thread with the thread loop unlocked
+ */
+void input_mix_configure(struct obs_audio_caption_src *acs, const char *inputs, double main_gain_db);
+void input_mix_destroy(struct obs_audio_caption_src *acs);
+
+/**
+ * Connect the streams waiting for a device with this name
+ * @warning Call with the thread loop locked
+ */
+void input_mix_node_added(struct obs_audio_caption_src *acs, const char *name, const char *friendly_name,
+			  uint32_t serial, uint32_t channels);
+
+/**
+ * @warning Call with the thread loop locked
+ */
+void input_mix_node_removed(struct obs_audio_caption_src *acs, uint32_t serial);
+
+/**
+ * Disconnect every stream, input_mix_node_added connects them again
+ * @warning Call with the thread loop locked
+ */
+void input_mix_disconnect(struct input_mix *mix);
+
+/**
+ * @warning Call with the thread loop locked
+ */
+void input_mix_set_active(struct input_mix *mix, bool active);
+
+/**
+ * Add interleaved audio to an input and feed what every input has to
+ * session, which may be NULL to drop it
+ * @warning Call from the streams' process callback
+ */
+void input_mix_push(struct input_mix *mix, size_t index, const short *samples, uint32_t frames, uint32_t channels,
+		    AprilASRSession session);
@@ -20,7 +20,7 @@
  * SPDX-License-Identifier: GPL-2.0-or-later
  */
 
-#include <stdio.h>
+#include <time.h>
 #include <errno.h>
 #include <signal.h>
 #include <math.h>
@@ -36,10 +36,10 @@
 #include <string.h>
 #include <assert.h>
 
-#include <obs-frontend-api.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include "tinyosc.h"
 
 void token_capitalizer_init(struct token_capitalizer *tc) {
@@ -99,10 +99,78 @@ void token_capitalizer_rewind(struct token_capitalizer *tc){
     tc->force_next_cap = false;
 }
 
-#define REL_LINE_IDX(HEAD, IDX) (4*AC_LINE_COUNT + (HEAD) + (IDX)) % AC_LINE_COUNT
+#define REL_LINE_IDX(LG, HEAD, IDX) (4*(LG)->line_count + (HEAD) + (IDX)) % (LG)->line_count
+
+#define AC_LINE_INITIAL 128
+
+// Multiple of 16 so the vector path can work on whole blocks
+#define MAX_TOKEN_SCRATCH 80
+#define TOKEN_MEMO_SIZE 128
+
+struct token_memo_entry {
+    const char *key;
+    bool capitalized;
+    uint8_t len;
+    char src[MAX_TOKEN_SCRATCH];
+    char text[MAX_TOKEN_SCRATCH];
+};
+
+static void line_reserve(struct line *l, size_t size) {
+    if(size <= l->cap) return;
+
+    size_t cap = l->cap ? l->cap : AC_LINE_INITIAL;
+    while(cap < size) cap *= 2;
+    l->text = brealloc(l->text, cap);
+    l->cap = cap;
+}
+
+static void line_history_free(struct line_history *h) {
+    bfree(h->offsets);
+    bfree(h->bytes);
+    memset(h, 0, sizeof(*h));
+}
+
+static void line_history_push(struct line_history *h, const char *text, size_t len) {
+    if(h->depth == 0 || len == 0) return;
+
+    if(h->count == h->depth){
+        h->first++;
+        h->count--;
+    }
+
+    // offsets holds 2*depth+1 entries, once the dropped ones take half of it
+    // move the live entries and their bytes back to the start
+    if(h->first >= h->depth){
+        size_t base = h->offsets[h->first];
+        memmove(h->bytes, h->bytes + base, h->used - base);
+        h->used -= base;
+        for(size_t i=0; i<=h->count; i++) h->offsets[i] = h->offsets[h->first + i] - base;
+        h->first = 0;
+    }
+
+    if(h->used + len > h->cap){
+        size_t cap = h->cap ? h->cap : AC_LINE_INITIAL;
+        while(cap < h->used + len) cap *= 2;
+        h->bytes = brealloc(h->bytes, cap);
+        h->cap = cap;
+    }
+
+    memcpy(h->bytes + h->used, text, len);
+    h->used += len;
+    h->count++;
+    h->offsets[h->first + h->count] = h->used;
+}
+
+// A partial result can be laid out over a line, backtracked and laid out
+// again, so only text of final results is pushed when the line is reused
+static void line_evict(struct line_generator *lg, size_t idx) {
+    struct line *l = &lg->lines[idx];
+    line_history_push(&lg->history, l->text, l->final_head);
+    l->final_head = 0;
+}
 
 void line_generator_init(struct line_generator *lg) {
-    for(int i=0; i<AC_LINE_COUNT; i++){
+    for(size_t i=0; i<lg->line_count; i++){
         lg->active_start_of_lines[i] = -1;
 
         lg->lines[i].start_head = 0;
@@ -111,27 +179,300 @@ void line_generator_init(struct line_generator *lg) {
 
     lg->current_line = 0;
     lg->active_start_of_lines[0] = 0;
-    lg->max_text_width = 50;
 
     token_capitalizer_init(&lg->tcap);
 
-    lg->socket_desc = -1;
+    // a new session comes with new token strings
+    if(!lg->token_memo) lg->token_memo = bzalloc(sizeof(struct token_memo_entry) * TOKEN_MEMO_SIZE);
+    else memset(lg->token_memo, 0, sizeof(struct token_memo_entry) * TOKEN_MEMO_SIZE);
 }
 
-void line_generator_end(struct line_generator *lg) {
-    if(lg->socket_desc >= 0){
-        close(lg->socket_desc);
+static const char *const sink_names[CAPTION_SINK_COUNT] = {"screen", "caption outputs", "OSC", "shared memory"};
+
+void line_generator_destroy(struct line_generator *lg) {
+    for(int i=0; i<CAPTION_SINK_COUNT; i++){
+        const struct caption_sink_stats *st = &lg->sinks[i].stats;
+        if(st->delivered + st->suppressed == 0) continue;
+        blog(LOG_INFO, "[catpion] %s: %llu caption updates delivered, %llu identical ones suppressed",
+            sink_names[i], (unsigned long long)st->delivered, (unsigned long long)st->suppressed);
     }
+
+    bfree(lg->token_memo);
+    lg->token_memo = NULL;
+    bfree(lg->capitalize);
+    lg->capitalize = NULL;
+    lg->capitalize_count = 0;
+    lg->capitalize_cap = 0;
+    for(size_t i=0; i<lg->line_count; i++) bfree(lg->lines[i].text);
+    bfree(lg->lines);
+    bfree(lg->active_start_of_lines);
+    line_history_free(&lg->history);
+    for(int i=0; i<AC_OUTPUT_SNAPSHOTS; i++){
+        text_snapshot_release(lg->output[i]);
+        lg->output[i] = NULL;
+    }
+
+    lg->lines = NULL;
+    lg->active_start_of_lines = NULL;
+    lg->line_count = 0;
+}
+
+void line_generator_set_layout(struct line_generator *lg, size_t line_count, size_t history_depth) {
+    if(line_count < 1) line_count = 1;
+    if(line_count > AC_LINE_COUNT_MAX) line_count = AC_LINE_COUNT_MAX;
+    if(history_depth > AC_HISTORY_DEPTH_MAX) history_depth = AC_HISTORY_DEPTH_MAX;
+
+    if(history_depth != lg->history.depth){
+        line_history_free(&lg->history);
+        lg->history.depth = history_depth;
+        if(history_depth > 0){
+            lg->history.offsets = bzalloc(sizeof(size_t) * (2*history_depth + 1));
+        }
+    }
+
+    if(line_count == lg->line_count) return;
+
+    for(size_t i=0; i<lg->line_count; i++) bfree(lg->lines[i].text);
+    bfree(lg->lines);
+    bfree(lg->active_start_of_lines);
+
+    lg->line_count = line_count;
+    lg->lines = bzalloc(sizeof(struct line) * line_count);
+    lg->active_start_of_lines = bzalloc(sizeof(ssize_t) * line_count);
+    for(size_t i=0; i<line_count; i++) line_reserve(&lg->lines[i], AC_LINE_INITIAL);
+
+    line_generator_clear(lg);
+}
+
+size_t line_generator_history_count(const struct line_generator *lg) {
+    return lg->history.count;
+}
+
+const char *line_generator_history_line(const struct line_generator *lg, size_t i, size_t *len) {
+    const struct line_history *h = &lg->history;
+    if(i >= h->count) return NULL;
+
+    size_t start = h->offsets[h->first + i];
+    *len = h->offsets[h->first + i + 1] - start;
+    return h->bytes + start;
+}
+
+const char *line_generator_current_line(const struct line_generator *lg, size_t *len) {
+    const struct line *curr = &lg->lines[lg->current_line];
+    *len = curr->head;
+    return curr->text;
+}
+
+void line_generator_end(struct line_generator *lg) {
+    lg->fanout = NULL;
+    lg->shm = NULL;
+    lg->outputs = NULL;
 }
 
 void line_generator_set_label(struct line_generator *lg, struct tp_source *text_src) {
     lg->text_src = text_src;
+    lg->sinks[CAPTION_SINK_SCREEN].has_hash = false;
+}
+
+void line_generator_set_fanout(struct line_generator *lg, struct caption_fanout *fanout) {
+    lg->fanout = fanout;
+    lg->sinks[CAPTION_SINK_OSC].has_hash = false;
+}
+
+void line_generator_set_shm(struct line_generator *lg, struct caption_shm *shm) {
+    lg->shm = shm;
+    lg->sinks[CAPTION_SINK_SHM].has_hash = false;
+}
+
+void line_generator_set_outputs(struct line_generator *lg, struct caption_outputs *outputs) {
+    lg->outputs = outputs;
+    lg->sinks[CAPTION_SINK_OUTPUTS].has_hash = false;
+}
+
+void line_generator_get_sink_stats(const struct line_generator *lg, struct caption_sink_stats stats[CAPTION_SINK_COUNT]) {
+    for(int i=0; i<CAPTION_SINK_COUNT; i++) stats[i] = lg->sinks[i].stats;
+}
+
+// Returns false and counts the update as suppressed if the sink already has this text
+static bool sink_changed(struct line_generator *lg, enum caption_sink sink, uint64_t hash) {
+    struct caption_sink_state *st = &lg->sinks[sink];
+    if(st->has_hash && st->hash == hash){
+        st->stats.suppressed++;
+        return false;
+    }
+    st->has_hash = true;
+    st->hash = hash;
+    st->stats.delivered++;
+    return true;
+}
+
+#define AC_LINE_CHARS 50
+
+// The font cache is owned by the caller and must outlive its use here
+// Narrower lines than this would only hold pieces of words
+#define LINE_MIN_WIDTH_TEXT "MMMM"
+
+void line_generator_set_font(struct line_generator *lg, struct text_font_cache *font, int max_width) {
+    lg->font = font;
+    if(font){
+        int min_width = (int)text_font_cache_width(font, LINE_MIN_WIDTH_TEXT);
+        lg->max_text_width = max_width > min_width ? max_width : min_width;
+    }else{
+        lg->max_text_width = AC_LINE_CHARS;
+    }
+}
+
+static size_t token_width(struct line_generator *lg, const char *token) {
+    if(lg->font) return text_font_cache_width(lg->font, token);
+    return g_utf8_strlen(token, -1);
+}
+
+// Lowercases the ASCII letters of buf in place, len must be a multiple of 16
+// and the bytes past the string zeroed. Returns false if there is any
+// non-ASCII byte, in which case buf must not be used.
+static bool ascii_tolower_blocks(char *buf, size_t len) {
+#ifdef __SSE2__
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z = _mm_set1_epi8('Z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    int high = 0;
+
+    for(size_t i=0; i<len; i+=16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        high |= _mm_movemask_epi8(v);
+
+        // bytes >= 0x80 compare as negative and are never in range
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmplt_epi8(v, after_z));
+        v = _mm_or_si128(v, _mm_and_si128(upper, case_bit));
+        _mm_storeu_si128((__m128i *)(buf + i), v);
+    }
+    return high == 0;
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t high_bits = 0x8080808080808080ULL;
+    uint64_t high = 0;
+
+    for(size_t i=0; i<len; i+=8){
+        uint64_t v;
+        memcpy(&v, buf + i, 8);
+        high |= v & high_bits;
+
+        // per byte: bit 7 of low7 + (0x80 - 'A') is set for >= 'A', and of
+        // low7 + (0x7F - 'Z') for > 'Z', no carry crosses into the next byte
+        uint64_t low7 = v & ~high_bits;
+        uint64_t ge_a = low7 + ones * (0x80 - 'A');
+        uint64_t gt_z = low7 + ones * (0x7F - 'Z');
+        uint64_t upper = ge_a & ~gt_z & ~v & high_bits;
+        v |= upper >> 2;
+        memcpy(buf + i, &v, 8);
+    }
+    return high == 0;
+#endif
+}
+
+// Per code point path for tokens with non-ASCII text
+static size_t token_normalize_utf8(const char *token, bool should_be_capitalized, char *token_scratch) {
+    char *out = token_scratch;
+    const char *p = token;
+    gunichar c;
+    while (*p) {
+        if((unsigned char)*p < 0x80){
+            c = (unsigned char)*p;
+            if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            if(should_be_capitalized && c >= 'a' && c <= 'z'){
+                c -= 'a' - 'A';
+                should_be_capitalized = false;
+            }
+            *out++ = (char)c;
+            p++;
+            continue;
+        }
+
+        c = g_utf8_get_char_validated(p, -1);
+        if(c == ((gunichar)-2) || c == ((gunichar)-1)) {
+            blog(LOG_DEBUG, "[catpion] Token is not valid UTF-8, truncating it");
+            break;
+        }
+
+        c = g_unichar_tolower(c);
+
+        if(should_be_capitalized){
+            gunichar c1 = g_unichar_toupper(c);
+            if(c != c1){
+                c = c1;
+                should_be_capitalized = false;
+            }
+        }
+
+        out += g_unichar_to_utf8(c, out);
+        if((out + 6) >= (token_scratch + MAX_TOKEN_SCRATCH)){
+            blog(LOG_WARNING, "[catpion] Token too long to normalize, truncating it");
+            break;
+        }
+
+        p = g_utf8_next_char(p);
+    }
+
+    *out = '\0';
+    return out - token_scratch;
+}
+
+// Lowercases a token, capitalizing its first letter if asked, into
+// token_scratch. April hands out the same token strings on every partial
+// so results are memoized by token pointer, checked against the source
+// text in case the pointer was reused.
+static struct text_view token_normalize(struct line_generator *lg, const char *token, bool should_be_capitalized, char *token_scratch) {
+    struct token_memo_entry *e = NULL;
+    if(lg->token_memo){
+        uintptr_t key = (uintptr_t)token;
+        e = &lg->token_memo[((key >> 4) ^ (key >> 12)) % TOKEN_MEMO_SIZE];
+        if(e->key == token && e->capitalized == should_be_capitalized && strcmp(e->src, token) == 0){
+            return (struct text_view){e->text, e->len};
+        }
+    }
+
+    size_t src_len = strlen(token);
+    size_t len = src_len;
+    if(len >= MAX_TOKEN_SCRATCH){
+        len = token_normalize_utf8(token, should_be_capitalized, token_scratch);
+        return (struct text_view){token_scratch, len};
+    }
+
+    size_t blocks = (len + 16) & ~(size_t)15;
+    memcpy(token_scratch, token, len);
+    memset(token_scratch + len, 0, blocks - len);
+
+    if(ascii_tolower_blocks(token_scratch, blocks)){
+        if(should_be_capitalized){
+            for(char *p = token_scratch; *p; p++){
+                if(*p >= 'a' && *p <= 'z'){
+                    *p -= 'a' - 'A';
+                    break;
+                }
+            }
+        }
+    }else{
+        len = token_normalize_utf8(token, should_be_capitalized, token_scratch);
+    }
+
+    if(e){
+        e->key = token;
+        e->capitalized = should_be_capitalized;
+        e->len = len;
+        memcpy(e->src, token, src_len + 1);
+        memcpy(e->text, token_scratch, len + 1);
+    }
+    return (struct text_view){token_scratch, len};
 }
 
-#define MAX_TOKEN_SCRATCH 72
 void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens) {
     // Add capitalization information
-    static bool should_capitalize[1024];
+    if(num_tokens > lg->capitalize_cap){
+        lg->capitalize_cap = num_tokens;
+        lg->capitalize = brealloc(lg->capitalize, sizeof(bool) * num_tokens);
+    }
+    bool *should_capitalize = lg->capitalize;
+    lg->capitalize_count = num_tokens;
 
     token_capitalizer_rewind(&lg->tcap);
     for(size_t i=0; i<num_tokens; i++){
@@ -142,10 +483,14 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
         }
     }
 
+    lg->result = APRIL_RESULT_RECOGNITION_PARTIAL;
+    lg->result_num_tokens = num_tokens;
+    lg->result_tokens = tokens;
+
     bool use_lowercase = true;//!g_settings_get_boolean(settings, "text-uppercase");
     char token_scratch[MAX_TOKEN_SCRATCH] = { 0 };
 
-    for(size_t i=0; i<AC_LINE_COUNT; i++){
+    for(size_t i=0; i<lg->line_count; i++){
         if(lg->active_start_of_lines[i] == -1) continue;
         size_t start_of_line = lg->active_start_of_lines[i];
 
@@ -162,8 +507,13 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
             if(i == lg->current_line) {
                 // oops... turns out our text isn't long enough for the new line
                 // backtrack to the previous line
+                if(lg->line_count == 1) {
+                    // there is no previous line, lay the tokens out again from the start
+                    lg->active_start_of_lines[0] = 0;
+                    return line_generator_update(lg, num_tokens, tokens);
+                }
                 lg->active_start_of_lines[lg->current_line] = -1;
-                lg->current_line = REL_LINE_IDX(lg->current_line, -1);
+                lg->current_line = REL_LINE_IDX(lg, lg->current_line, -1);
                 return line_generator_update(lg, num_tokens, tokens);
             } else {
                 continue;
@@ -171,52 +521,18 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
         }
 
 
-        ssize_t end = lg->active_start_of_lines[REL_LINE_IDX(i, 1)];
+        ssize_t end = lg->active_start_of_lines[REL_LINE_IDX(lg, i, 1)];
         if((end == -1) || (i == lg->current_line)) end = num_tokens;
 
         // print line
         for(size_t j=start_of_line; j<((size_t)end);) {
             size_t skipahead = 1;
-            const char *token = tokens[j].token;
-
-            bool should_be_capitalized = should_capitalize[j];
+            struct text_view token;
 
             if(use_lowercase){
-                char *out = token_scratch;
-                const char *p = tokens[j].token;
-                gunichar c;
-                while (*p) {
-                    c = g_utf8_get_char_validated(p, -1);
-                    if(c == ((gunichar)-2)) {
-                        printf("gunichar -2 \n");
-                        break;
-                    }else if(c == ((gunichar)-1)) {
-                        printf("gunichar -1 \n");
-                        break;
-                    }
-
-                    c = g_unichar_tolower(c);
-
-                    if(should_be_capitalized){
-                        gunichar c1 = g_unichar_toupper(c);
-                        if(c != c1){
-                            c = c1;
-                            should_be_capitalized = false;
-                        }
-                    }
-
-                    out += g_unichar_to_utf8(c, out);
-                    if((out + 6) >= (token_scratch + MAX_TOKEN_SCRATCH)){
-                        printf("Unicode too big for token scratch!\n");
-                        break;
-                    }
-
-                    p = g_utf8_next_char(p);
-                }
-
-                *out = '\0';
-
-                token = token_scratch;
+                token = token_normalize(lg, tokens[j].token, should_capitalize[j], token_scratch);
+            }else{
+                token = text_view_from_str(tokens[j].token);
             }
 
             // skip if line is too long to safely write
@@ -228,8 +544,10 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
 
             // break line if too long
             if(i == lg->current_line){
-                curr->len += strlen(token);
-                if(curr->len >= lg->max_text_width) {
+                curr->len += token_width(lg, token.text);
+                // every line keeps at least one token, a token wider than
+                // the line overflows it instead of breaking forever
+                if(curr->len >= (size_t)lg->max_text_width && (j > start_of_line || curr->start_head != 0)) {
                     size_t tgt_brk = j;
                     // find previous word boundary
                     while((!(tokens[tgt_brk].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) && (tgt_brk > start_of_line)) tgt_brk--;
@@ -238,8 +556,9 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
                     // unless this line has starting text
                     if((tgt_brk == start_of_line) && (curr->start_head == 0)) tgt_brk = j;
 
-                    // line break
-                    lg->current_line = REL_LINE_IDX(lg->current_line, 1);
+                    // line break, the oldest line scrolls into the history
+                    lg->current_line = REL_LINE_IDX(lg, lg->current_line, 1);
+                    line_evict(lg, lg->current_line);
                     lg->active_start_of_lines[lg->current_line] = tgt_brk;
                     lg->lines[lg->current_line].start_head = 0;
                     lg->lines[lg->current_line].start_len = 0;
@@ -248,7 +567,10 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
             }
 
             // write the actual line
-            curr->head += sprintf(&curr->text[curr->head], "%s", token);
+            line_reserve(curr, curr->head + token.len + 1);
+            memcpy(&curr->text[curr->head], token.text, token.len);
+            curr->head += token.len;
+            curr->text[curr->head] = '\0';
             
             assert(curr->head < AC_LINE_MAX);
 
@@ -258,8 +580,15 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
 }
 
 void line_generator_finalize(struct line_generator *lg) {
+    lg->result = APRIL_RESULT_RECOGNITION_FINAL;
+
+    // the lines laid out for this result are final now
+    for(size_t i=0; i<lg->line_count; i++){
+        if(lg->active_start_of_lines[i] != -1) lg->lines[i].final_head = lg->lines[i].head;
+    }
+
     // reset active
-    for(size_t i=0; i<AC_LINE_COUNT; i++) lg->active_start_of_lines[i] = -1;
+    for(size_t i=0; i<lg->line_count; i++) lg->active_start_of_lines[i] = -1;
 
     // freeze the current line thus far
     lg->lines[lg->current_line].start_head = lg->lines[lg->current_line].head;
@@ -270,11 +599,16 @@ void line_generator_finalize(struct line_generator *lg) {
 }
 
 void line_generator_break(struct line_generator *lg) {
+    lg->result = APRIL_RESULT_SILENCE;
+    lg->result_num_tokens = 0;
+    lg->result_tokens = NULL;
+
     // insert new line
-    lg->current_line = REL_LINE_IDX(lg->current_line, 1);
+    lg->current_line = REL_LINE_IDX(lg, lg->current_line, 1);
+    line_evict(lg, lg->current_line);
 
     // reset active
-    for(int i=0; i<AC_LINE_COUNT; i++) lg->active_start_of_lines[i] = -1;
+    for(size_t i=0; i<lg->line_count; i++) lg->active_start_of_lines[i] = -1;
 
     // set new line to start at 0
     lg->active_start_of_lines[lg->current_line] = 0;
@@ -287,66 +621,206 @@ void line_generator_break(struct line_generator *lg) {
     lg->lines[lg->current_line].start_len = 0;
 }
 
+void line_generator_clear(struct line_generator *lg) {
+    for(size_t i=0; i<lg->line_count; i++){
+        lg->active_start_of_lines[i] = -1;
+
+        lg->lines[i].text[0] = '\0';
+        lg->lines[i].head = 0;
+        lg->lines[i].len = 0;
+        lg->lines[i].start_head = 0;
+        lg->lines[i].start_len = 0;
+        lg->lines[i].final_head = 0;
+    }
+
+    lg->current_line = 0;
+    lg->active_start_of_lines[0] = 0;
+
+    token_capitalizer_init(&lg->tcap);
+}
+
+// The render thread holds on to at most the two latest snapshots, so one of
+// them is normally free to be written again
+static struct text_snapshot *line_generator_output(struct line_generator *lg, size_t size) {
+    int slot = -1;
+    for(int i=0; i<AC_OUTPUT_SNAPSHOTS; i++){
+        struct text_snapshot *out = lg->output[i];
+        if(!out || text_snapshot_exclusive(out)){
+            if(out && out->cap >= size) return out;
+            slot = i;
+        }
+    }
+
+    if(slot == -1) slot = 0;
+    text_snapshot_release(lg->output[slot]);
+    lg->output[slot] = text_snapshot_alloc((size + 255) & ~(size_t)255);
+    return lg->output[slot];
+}
+
 void line_generator_set_text(struct line_generator *lg) {
-    static char last_sent[AC_LINE_MAX+100];
-    char *head = &lg->output[0];
-    *head = '\0';
-
-    for(int i=AC_LINE_COUNT-1; i>=0; i--) {
-        struct line *curr = &lg->lines[REL_LINE_IDX(lg->current_line, -i)];
-        head += sprintf(head, "%s", curr->text);
-
-        if(i == AC_LINE_COUNT-1){
-            if(lg->to_stream || lg->to_osc){
-                if(strcmp(last_sent, curr->text) != 0){
-                    if(lg->to_stream){
-                        obs_output_t *output = NULL;
-                        output = obs_frontend_get_streaming_output();
-                        if (output) {
-                            obs_output_output_caption_text2(output, head, 2.0);
-                            obs_output_release(output);
-                        }
-                    }
-                    if(lg->to_osc){
-                        if(lg->socket_desc < 0){
-                            lg->socket_desc = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-                            if(lg->socket_desc < 0){
-                                blog(LOG_ERROR, "[catpion] can't open socket, disabling osc internally");
-                                lg->to_osc = false;
-                            }
-
-                            // Set port and IP:
-                            lg->server_addr.sin_family = AF_INET;
-                            lg->server_addr.sin_port = htons(lg->osc_port);
-                            lg->server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-                        }
-                    }
-                    if(lg->to_osc){
-                        static char buffer[AC_LINE_MAX+100];
-                        static int len;
-
-                        lg->server_addr.sin_port = htons(lg->osc_port);
-                        if(lg->socket_desc >= 0 && lg->osc_port > 0) {
-                            int rc;
-                            len = tosc_writeMessage(
-                                buffer, AC_LINE_MAX+100,
-                                "/obs-catpion",
-                                "s",
-                                curr->text
-                            );
-
-                            rc = sendto(lg->socket_desc, buffer, len, 0,
-                                (struct sockaddr*)&(lg->server_addr), sizeof(lg->server_addr));
-                        }
-                    }
-                    strncpy(last_sent, curr->text, AC_LINE_MAX+100);
-                    blog(LOG_DEBUG, "[catpion] %s", curr->text);
-                }
+    struct text_view lines[AC_LINE_COUNT_MAX];
+    const int line_count = lg->line_count;
+
+    size_t size = 1;
+    uint64_t hash = TEXT_HASH_INIT;
+    for(int i=0; i<line_count; i++){
+        struct line *curr = &lg->lines[REL_LINE_IDX(lg, lg->current_line, i - line_count + 1)];
+        lines[i] = (struct text_view){curr->text, curr->head};
+        if(i != 0) hash = text_hash_update(hash, "\n", 1);
+        hash = text_hash_update(hash, curr->text, curr->head);
+        size += curr->head + 1;
+    }
+
+    // The oldest line goes to OSC once it stops changing
+    const struct text_view *oldest = &lines[0];
+    uint64_t oldest_hash = text_hash_update(TEXT_HASH_INIT, oldest->text, oldest->len);
+
+    if(lg->to_osc && !lg->osc_bundle && lg->fanout && sink_changed(lg, CAPTION_SINK_OSC, oldest_hash)){
+        struct caption_fanout_record *rec = caption_fanout_begin(lg->fanout);
+        int len = tosc_writeMessage(
+            rec->packet, CAPTION_FANOUT_PACKET_MAX,
+            "/obs-catpion",
+            "s",
+            oldest->text
+        );
+
+        rec->text_len = oldest->len;
+        if(rec->text_len >= CAPTION_FANOUT_TEXT_MAX) rec->text_len = CAPTION_FANOUT_TEXT_MAX - 1;
+        memcpy(rec->text, oldest->text, rec->text_len);
+
+        caption_fanout_commit(lg->fanout, rec, len > 0 ? len : 0, CAPTION_FANOUT_FINAL);
+        blog(LOG_DEBUG, "[catpion] %s", oldest->text);
+    }
+
+    if(lg->text_src && sink_changed(lg, CAPTION_SINK_SCREEN, hash)){
+        struct text_snapshot *output = line_generator_output(lg, size);
+        char *head = output->text;
+        for(int i=0; i<line_count; i++){
+            if(i != 0) *head++ = '\n';
+            memcpy(head, lines[i].text, lines[i].len);
+            head += lines[i].len;
+        }
+        *head = '\0';
+        output->len = head - output->text;
+
+        tp_edit_text(lg->text_src, output);
+    }
+
+    if(lg->shm){
+        enum catpion_shm_kind kind = CATPION_SHM_PARTIAL;
+        if(lg->result == APRIL_RESULT_RECOGNITION_FINAL) kind = CATPION_SHM_FINAL;
+        else if(lg->result == APRIL_RESULT_SILENCE) kind = CATPION_SHM_SILENCE;
+
+        if(sink_changed(lg, CAPTION_SINK_SHM, hash ^ kind)){
+            caption_shm_publish(lg->shm, kind, lines, line_count, lg->result_num_tokens, lg->result_tokens);
+        }
+    }
+    lg->result_num_tokens = 0;
+    lg->result_tokens = NULL;
+}
+
+void line_generator_send_outputs(struct line_generator *lg, AprilResultType result, size_t num_tokens, const AprilToken *tokens) {
+    if(!lg->outputs) return;
+    if(result != APRIL_RESULT_RECOGNITION_PARTIAL && result != APRIL_RESULT_RECOGNITION_FINAL) return;
+
+    // The last word of a partial may still change, hold it back
+    size_t stable = num_tokens;
+    if(result == APRIL_RESULT_RECOGNITION_PARTIAL){
+        stable = 0;
+        for(size_t i=num_tokens; i>0; i--){
+            if(tokens[i-1].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT){
+                stable = i-1;
+                break;
             }
         }
+    }
 
-        if(i != 0) head += sprintf(head, "\n");
+    // Same casing as the lines on screen, line_generator_update already
+    // worked out the capitalization for these tokens
+    char token_scratch[MAX_TOKEN_SCRATCH] = { 0 };
+    char text[AC_LINE_MAX];
+    size_t len = 0;
+    for(size_t i=0; i<stable; i++){
+        bool cap = (i < lg->capitalize_count) && lg->capitalize[i];
+        struct text_view token = token_normalize(lg, tokens[i].token, cap, token_scratch);
+        if(len + token.len >= AC_LINE_MAX) break;
+        memcpy(&text[len], token.text, token.len);
+        len += token.len;
     }
+    text[len] = '\0';
+
+    uint64_t hash = text_hash_update(TEXT_HASH_INIT, text, len) ^ (result == APRIL_RESULT_RECOGNITION_FINAL);
+    if(!sink_changed(lg, CAPTION_SINK_OUTPUTS, hash)) return;
+
+    caption_outputs_push(lg->outputs, text, len, result == APRIL_RESULT_RECOGNITION_FINAL);
+}
+
+// Seconds between the NTP epoch (1900) and the unix epoch (1970)
+#define NTP_UNIX_OFFSET 2208988800ULL
 
-    if(lg->text_src) tp_edit_text(lg->text_src, lg->output);
-}
\ No newline at end of file
+static uint64_t osc_timetag_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t secs = (uint64_t)ts.tv_sec + NTP_UNIX_OFFSET;
+    uint64_t frac = ((uint64_t)ts.tv_nsec << 32) / 1000000000ULL;
+    return (secs << 32) | frac;
+}
+
+// Worst case size of an OSC message with a single string argument plus the
+// bundle element size prefix
+#define OSC_STRING_MSG_SIZE(ADDR_LEN, STR_LEN) (4 + (ADDR_LEN) + 4 + 8 + (STR_LEN) + 4 + 16)
+
+void line_generator_send_bundle(struct line_generator *lg, AprilResultType result, size_t num_tokens, const AprilToken *tokens) {
+    if(!lg->to_osc || !lg->osc_bundle || !lg->fanout) return;
+
+    const char *address;
+    uint32_t flags = 0;
+    switch(result) {
+        case APRIL_RESULT_RECOGNITION_PARTIAL: address = "/obs-catpion/partial"; break;
+        case APRIL_RESULT_RECOGNITION_FINAL: address = "/obs-catpion/final"; flags = CAPTION_FANOUT_FINAL; break;
+        case APRIL_RESULT_SILENCE: address = "/obs-catpion/silence"; break;
+        default: return;
+    }
+
+    uint64_t hash = text_hash_update(TEXT_HASH_INIT, address, strlen(address));
+    for(size_t i=0; i<num_tokens; i++){
+        hash = text_hash_update(hash, tokens[i].token, strlen(tokens[i].token) + 1);
+    }
+    if(!sink_changed(lg, CAPTION_SINK_OSC, hash)) return;
+
+    struct caption_fanout_record *rec = caption_fanout_begin(lg->fanout);
+
+    // Join the raw tokens into the result text
+    char *text = rec->text;
+    size_t text_len = 0;
+    for(size_t i=0; i<num_tokens; i++){
+        size_t tlen = strlen(tokens[i].token);
+        if(text_len + tlen >= CAPTION_FANOUT_TEXT_MAX) break;
+        memcpy(&text[text_len], tokens[i].token, tlen);
+        text_len += tlen;
+    }
+    text[text_len] = '\0';
+    rec->text_len = text_len;
+
+    tosc_bundle bundle;
+    tosc_writeBundle(&bundle, osc_timetag_now(), rec->packet, CAPTION_FANOUT_PACKET_MAX);
+    tosc_writeNextMessage(&bundle, address, "s", text);
+
+    // One message per token: text, time offset in ms, flags and logprob.
+    // Tokens that don't fit in a single datagram are left out.
+    for(size_t i=0; i<num_tokens; i++){
+        size_t needed = OSC_STRING_MSG_SIZE(sizeof("/obs-catpion/token"), strlen(tokens[i].token)) + 12;
+        if(bundle.bundleLen + needed >= bundle.bufLen) {
+            blog(LOG_DEBUG, "[catpion] OSC bundle full, dropped %zu tokens", num_tokens - i);
+            break;
+        }
+        tosc_writeNextMessage(&bundle, "/obs-catpion/token", "siif",
+            tokens[i].token,
+            (int)tokens[i].time_ms,
+            (int)tokens[i].flags,
+            tokens[i].logprob);
+    }
+
+    caption_fanout_commit(lg->fanout, rec, tosc_getBundleLength(&bundle), flags);
+}
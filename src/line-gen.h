@@ -25,14 +25,19 @@
 #include <sys/types.h>
 #include <april_api.h>
 
-#include <sys/socket.h>
-#include <arpa/inet.h>
-
 #include <obs-module.h>
 #include "obs-text-pthread.h"
+#include "caption-fanout.h"
+#include "caption-shm.h"
+#include "caption-outputs.h"
+#include "text-metrics.h"
+#include "text-snapshot.h"
 
 #define AC_LINE_MAX 4096
 #define AC_LINE_COUNT 2
+#define AC_LINE_COUNT_MAX 8
+#define AC_HISTORY_DEPTH_MAX 10000
+#define AC_OUTPUT_SNAPSHOTS 3
 
 struct token_capitalizer {
     bool is_english;
@@ -48,41 +53,115 @@ void token_capitalizer_finish(struct token_capitalizer *tc);
 void token_capitalizer_rewind(struct token_capitalizer *tc);
 
 struct line {
-    char text[AC_LINE_MAX];
+    // grows as needed, up to AC_LINE_MAX
+    char *text;
+    size_t cap;
 
     size_t start_head;
     size_t start_len;
 
     size_t head;
     size_t len;
+
+    // leading bytes of text that came from final results, only these
+    // are kept in the history once the line scrolls away
+    size_t final_head;
+};
+
+// Lines that scrolled out of view, stored back to back in one arena.
+// Live entry i (0 is the oldest) spans offsets[first+i] to offsets[first+i+1].
+struct line_history {
+    size_t depth;
+    size_t first;
+    size_t count;
+    size_t *offsets;
+
+    char *bytes;
+    size_t used;
+    size_t cap;
+};
+
+struct token_memo_entry;
+
+enum caption_sink {
+    CAPTION_SINK_SCREEN,
+    CAPTION_SINK_OUTPUTS,
+    CAPTION_SINK_OSC,
+    CAPTION_SINK_SHM,
+    CAPTION_SINK_COUNT,
+};
+
+struct caption_sink_stats {
+    uint64_t delivered;
+    uint64_t suppressed;
+};
+
+// Hash of the text last delivered to a sink, identical updates are dropped
+struct caption_sink_state {
+    bool has_hash;
+    uint64_t hash;
+    struct caption_sink_stats stats;
 };
 
 struct line_generator {
+    size_t line_count;
     size_t current_line;
-    struct line lines[AC_LINE_COUNT];
+    struct line *lines;
 
     // Denotes the index within the active token array at which the line starts
     // If -1, means the active tokens don't reach that line yet
-    ssize_t active_start_of_lines[AC_LINE_COUNT];
+    ssize_t *active_start_of_lines;
 
-    char output[AC_LINE_MAX * AC_LINE_COUNT];
+    struct line_history history;
 
+    struct text_snapshot *output[AC_OUTPUT_SNAPSHOTS];
+    struct caption_sink_state sinks[CAPTION_SINK_COUNT];
+
+    // Line width in pixels when a font cache is set, otherwise in characters
     int max_text_width;
+    struct text_font_cache *font;
     struct token_capitalizer tcap;
+    struct token_memo_entry *token_memo;
+
+    // Whether each token of the latest result starts capitalized,
+    // filled by line_generator_update
+    bool *capitalize;
+    size_t capitalize_count;
+    size_t capitalize_cap;
 
-	bool to_stream;
 	bool to_osc;
-    int osc_port;
+    bool osc_bundle;
     struct tp_source *text_src;
-
-    int socket_desc;
-    struct sockaddr_in server_addr;
+    struct caption_fanout *fanout;
+    struct caption_shm *shm;
+    struct caption_outputs *outputs;
+
+    // Result being shown, only valid during the april result callback
+    AprilResultType result;
+    size_t result_num_tokens;
+    const AprilToken *result_tokens;
 };
 
 void line_generator_init(struct line_generator *lg);
+void line_generator_destroy(struct line_generator *lg);
+void line_generator_set_layout(struct line_generator *lg, size_t line_count, size_t history_depth);
 void line_generator_end(struct line_generator *lg);
 void line_generator_set_label(struct line_generator *lg, struct tp_source *text_src);
+void line_generator_set_fanout(struct line_generator *lg, struct caption_fanout *fanout);
+void line_generator_set_shm(struct line_generator *lg, struct caption_shm *shm);
+void line_generator_set_outputs(struct line_generator *lg, struct caption_outputs *outputs);
+void line_generator_set_font(struct line_generator *lg, struct text_font_cache *font, int max_width);
 void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens);
 void line_generator_finalize(struct line_generator *lg);
 void line_generator_break(struct line_generator *lg);
+void line_generator_clear(struct line_generator *lg);
 void line_generator_set_text(struct line_generator *lg);
+void line_generator_get_sink_stats(const struct line_generator *lg, struct caption_sink_stats stats[CAPTION_SINK_COUNT]);
+void line_generator_send_outputs(struct line_generator *lg, AprilResultType result, size_t num_tokens, const AprilToken *tokens);
+void line_generator_send_bundle(struct line_generator *lg, AprilResultType result, size_t num_tokens, const AprilToken *tokens);
+
+// History entries are only valid while the caller holds the generator's lock
+size_t line_generator_history_count(const struct line_generator *lg);
+const char *line_generator_history_line(const struct line_generator *lg, size_t i, size_t *len);
+// Line being written, valid until the next update
+const char *line_generator_current_line(const struct line_generator *lg, size_t *len);
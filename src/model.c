@@ -1,25 +1,46 @@
 #include "model.h"
 
 #include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <pthread.h>
+#include <stdint.h>
 
 struct model_src {
 	size_t u; //usage
 	AprilASRModel m; //model
+	struct pooled_session *idle; //sessions ready to be handed out again
+	size_t num_idle;
 };
 
 struct model_src models[MAX_MODELS] = {0};
 size_t cur_model = 0;
+// guards usage counts and the session pools
+static pthread_mutex_t models_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* April only loads a model from a path, copying the weights into its own
+ * heap. Sharing them between OBS processes through a read-only mapping of
+ * the file is blocked on april gaining a constructor that takes a buffer. */
+static AprilASRModel model_load(const char *input_model) {
+	return aam_create_model(input_model);
+}
+
+static void model_unload(struct model_src *src) {
+	aam_free(src->m);
+	src->m = NULL;
+	src->u = 0;
+}
 
-void ModelNew(const char*input_model) {
+size_t ModelNew(const char*input_model) {
 	size_t next_model = (cur_model + 1) % MAX_MODELS;
-	size_t old_model = cur_model;
 
 	// create model on next id
 	models[next_model].u = 0;
-	models[next_model].m = aam_create_model(input_model);
+	models[next_model].m = model_load(input_model);
 	if(models[next_model].m == NULL){
 		blog(LOG_INFO, "[catpion] Loading model %s failed!", input_model);
-		return;
+		return MAX_MODELS;
 	}
 	else {
 		blog(LOG_INFO, "[catpion] Model %d name: %s", next_model, aam_get_name(models[next_model].m));
@@ -28,8 +49,78 @@ void ModelNew(const char*input_model) {
 		blog(LOG_INFO, "[catpion] Model %d samplerate: %ld", next_model, aam_get_sample_rate(models[next_model].m));
 	}
 
-	// change current model id
-	cur_model = next_model;
+	return next_model;
+}
+
+void ModelSetCurrent(size_t id) {
+	if(id >= MAX_MODELS || models[id].m == NULL) return;
+	cur_model = id;
+}
+
+// Seconds of silence the throwaway session is fed
+#define PREWARM_SECONDS 3
+// fed in 100 ms chunks
+#define PREWARM_CHUNK_DIV 10
+
+struct model_prewarm {
+	size_t id;
+	model_prewarm_cb done;
+	void *data;
+};
+
+static void prewarm_handler(void *data, AprilResultType result, size_t count, const AprilToken *tokens) {
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(result);
+	UNUSED_PARAMETER(count);
+	UNUSED_PARAMETER(tokens);
+}
+
+static void *model_prewarm_thread(void *data) {
+	struct model_prewarm *pw = data;
+	AprilASRModel model = models[pw->id].m;
+
+	os_set_thread_name("catpion-prewarm");
+	uint64_t start = os_gettime_ns();
+
+	// Synchronous session, the feed calls run the whole pipeline here
+	AprilConfig config = { 0 };
+	config.handler = prewarm_handler;
+	config.flags = APRIL_CONFIG_FLAG_ZERO_BIT;
+	AprilASRSession session = aas_create_session(model, config);
+	if(session != NULL) {
+		size_t chunk = aam_get_sample_rate(model) / PREWARM_CHUNK_DIV;
+		short *silence = bzalloc(chunk * sizeof(short));
+		for(size_t i = 0; i < PREWARM_SECONDS * PREWARM_CHUNK_DIV; i++) {
+			aas_feed_pcm16(session, silence, chunk);
+		}
+		aas_flush(session);
+		aas_free(session);
+		bfree(silence);
+	}
+
+	uint64_t elapsed = os_gettime_ns() - start;
+	blog(LOG_INFO, "[catpion] Model %zu prewarmed in %.1f ms", pw->id, elapsed / 1000000.0);
+
+	pw->done(pw->id, elapsed, pw->data);
+	bfree(pw);
+	return NULL;
+}
+
+void ModelPrewarm(size_t id, model_prewarm_cb done, void *data) {
+	struct model_prewarm *pw = bzalloc(sizeof(struct model_prewarm));
+	pw->id = id;
+	pw->done = done;
+	pw->data = data;
+
+	pthread_t thread;
+	if(id >= MAX_MODELS || models[id].m == NULL ||
+	   pthread_create(&thread, NULL, model_prewarm_thread, pw) != 0) {
+		blog(LOG_WARNING, "[catpion] Can't prewarm model %zu", id);
+		done(id, 0, data);
+		bfree(pw);
+		return;
+	}
+	pthread_detach(thread);
 }
 
 void ModelDelete() {
@@ -47,18 +138,160 @@ AprilASRModel ModelGet(size_t id){
 	return models[id].m;
 }
 
-void ModelTake(size_t id){
+static void model_take(size_t id){
 	if(models[id].m == NULL) return;
 	++models[id].u;
 }
 
-void ModelRelease(size_t id) {
+static void model_release(size_t id) {
 	if(models[id].m == NULL) return;
 	if(--models[id].u <= 0)
 	{
-		aam_free(models[id].m);
-		models[id].m = NULL;
-		models[id].u = 0;
+		model_unload(&models[id]);
 		blog(LOG_INFO, "[catpion] Unloaded model %d", id);
 	}
 }
+
+void ModelTake(size_t id){
+	pthread_mutex_lock(&models_mutex);
+	model_take(id);
+	pthread_mutex_unlock(&models_mutex);
+}
+
+void ModelRelease(size_t id) {
+	pthread_mutex_lock(&models_mutex);
+	model_release(id);
+	pthread_mutex_unlock(&models_mutex);
+}
+
+// Idle sessions kept per model
+#define SESSION_POOL_IDLE_MAX 4
+
+/* Results reach whoever holds the session now, nobody once it's back in
+ * the pool */
+static void pooled_handler(void *data, AprilResultType result, size_t count, const AprilToken *tokens) {
+	struct pooled_session *ps = data;
+	pthread_mutex_lock(&ps->mutex);
+	if(ps->handler != NULL) {
+		ps->handler(ps->userdata, result, count, tokens);
+	}
+	pthread_mutex_unlock(&ps->mutex);
+}
+
+static void session_free(struct pooled_session *ps) {
+	aas_free(ps->session);
+	pthread_mutex_destroy(&ps->mutex);
+	ModelRelease(ps->model_id);
+	bfree(ps);
+}
+
+static void session_free_list(struct pooled_session *ps) {
+	while(ps != NULL) {
+		struct pooled_session *next = ps->next;
+		session_free(ps);
+		ps = next;
+	}
+}
+
+struct pooled_session *SessionAcquire(size_t model_id, AprilRecognitionResultHandler handler, void *userdata) {
+	if(model_id >= MAX_MODELS) return NULL;
+
+	pthread_mutex_lock(&models_mutex);
+	AprilASRModel model = models[model_id].m;
+	struct pooled_session *ps = models[model_id].idle;
+	if(ps != NULL) {
+		models[model_id].idle = ps->next;
+		models[model_id].num_idle--;
+		ps->next = NULL;
+	} else if(model != NULL) {
+		// the session keeps the model alive
+		model_take(model_id);
+	}
+	pthread_mutex_unlock(&models_mutex);
+
+	if(ps != NULL) {
+		blog(LOG_DEBUG, "[catpion] Reusing session %p of model %zu", ps->session, model_id);
+	} else if(model != NULL) {
+		ps = bzalloc(sizeof(struct pooled_session));
+		pthread_mutex_init(&ps->mutex, NULL);
+		ps->model_id = model_id;
+
+		AprilConfig config = { 0 };
+		config.handler = pooled_handler;
+		config.userdata = ps;
+		config.flags = APRIL_CONFIG_FLAG_ASYNC_RT_BIT;
+		ps->session = aas_create_session(model, config);
+		if(ps->session == NULL) {
+			blog(LOG_WARNING, "[catpion] Can't create a session for model %zu", model_id);
+			pthread_mutex_destroy(&ps->mutex);
+			bfree(ps);
+			ModelRelease(model_id);
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ps->mutex);
+	ps->handler = handler;
+	ps->userdata = userdata;
+	pthread_mutex_unlock(&ps->mutex);
+	return ps;
+}
+
+void SessionRelease(struct pooled_session *ps) {
+	if(ps == NULL) return;
+
+	// finish what was fed, the results still go to the old holder
+	aas_flush(ps->session);
+
+	pthread_mutex_lock(&ps->mutex);
+	ps->handler = NULL;
+	ps->userdata = NULL;
+	pthread_mutex_unlock(&ps->mutex);
+
+	size_t id = ps->model_id;
+	pthread_mutex_lock(&models_mutex);
+	if(id == cur_model && models[id].num_idle < SESSION_POOL_IDLE_MAX) {
+		ps->next = models[id].idle;
+		models[id].idle = ps;
+		models[id].num_idle++;
+		ps = NULL;
+	}
+	pthread_mutex_unlock(&models_mutex);
+
+	if(ps != NULL) session_free(ps);
+}
+
+void SessionPoolTrim() {
+	struct pooled_session *stale[MAX_MODELS] = {0};
+
+	pthread_mutex_lock(&models_mutex);
+	for(size_t i = 0; i < MAX_MODELS; i++) {
+		if(i == cur_model) continue;
+		stale[i] = models[i].idle;
+		models[i].idle = NULL;
+		models[i].num_idle = 0;
+	}
+	pthread_mutex_unlock(&models_mutex);
+
+	for(size_t i = 0; i < MAX_MODELS; i++) {
+		session_free_list(stale[i]);
+	}
+}
+
+void SessionPoolDestroy() {
+	struct pooled_session *idle[MAX_MODELS];
+
+	pthread_mutex_lock(&models_mutex);
+	for(size_t i = 0; i < MAX_MODELS; i++) {
+		idle[i] = models[i].idle;
+		models[i].idle = NULL;
+		models[i].num_idle = 0;
+	}
+	pthread_mutex_unlock(&models_mutex);
+
+	for(size_t i = 0; i < MAX_MODELS; i++) {
+		session_free_list(idle[i]);
+	}
+}
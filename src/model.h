@@ -1,5 +1,9 @@
 #pragma once
 #include <april_api.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -8,13 +12,56 @@ extern "C"
 
 #define MAX_MODELS 3
 
-void ModelNew(const char* input_model);
+typedef void (*model_prewarm_cb)(size_t id, uint64_t elapsed_ns, void *data);
+
+/**
+ * Load a model into the next slot, it's used once made current
+ * @return the model id, MAX_MODELS if it couldn't be loaded
+ */
+size_t ModelNew(const char* input_model);
+void ModelSetCurrent(size_t id);
+/**
+ * Run a throwaway session over a few seconds of silence on a background
+ * thread, so the runtime's lazy allocations don't land on the first
+ * utterance. done is called from that thread.
+ */
+void ModelPrewarm(size_t id, model_prewarm_cb done, void *data);
 void ModelDelete();
 size_t ModelCurID();
 AprilASRModel ModelGet(size_t id);
 void ModelTake(size_t id);
 void ModelRelease(size_t id);
 
+/**
+ * Session handed out by a model's pool. Results go to handler until the
+ * session is released, then it's flushed and kept for the next caller
+ * instead of being recreated.
+ */
+struct pooled_session {
+	AprilASRSession session;
+	size_t model_id;
+
+	pthread_mutex_t mutex;
+	AprilRecognitionResultHandler handler;
+	void *userdata;
+
+	struct pooled_session *next;
+};
+
+/**
+ * Take an idle session of the model or create one, which may take a while
+ * @return NULL if the model isn't loaded or the session can't be created
+ */
+struct pooled_session *SessionAcquire(size_t model_id, AprilRecognitionResultHandler handler, void *userdata);
+/**
+ * Flush the session and put it back in its model's pool, sessions of a
+ * model that isn't current anymore are freed
+ */
+void SessionRelease(struct pooled_session *ps);
+/** Free the idle sessions of models that aren't current */
+void SessionPoolTrim();
+void SessionPoolDestroy();
+
 #ifdef __cplusplus
 }
 #endif
@@ -206,7 +206,7 @@ static inline void blend_shadow(uint8_t *s, const int stride, const uint32_t h,
 		}
 }
 
-static struct tp_texture *tp_draw_texture(struct tp_config *config, char *text)
+static struct tp_texture *tp_draw_texture(struct tp_config *config, const char *text, size_t len)
 {
 	struct tp_texture *n = bzalloc(sizeof(struct tp_texture));
 
@@ -255,13 +255,18 @@ static struct tp_texture *tp_draw_texture(struct tp_config *config, char *text)
 	pango_layout_set_justify(layout, !!(config->align & ALIGN_JUSTIFY));
 	pango_layout_set_indent(layout, config->indent * PANGO_SCALE);
 
-	pango_layout_set_width(layout, body_width << 10);
+	// Pre-wrapped lines only need the layout width to align them
+	if (config->prewrapped && !(config->align & (ALIGN_CENTER | ALIGN_RIGHT | ALIGN_JUSTIFY)) &&
+	    config->ellipsize == PANGO_ELLIPSIZE_NONE)
+		pango_layout_set_width(layout, -1);
+	else
+		pango_layout_set_width(layout, body_width << 10);
 	pango_layout_set_auto_dir(layout, config->auto_dir);
 	pango_layout_set_wrap(layout, config->wrapmode);
 	pango_layout_set_ellipsize(layout, config->ellipsize);
 	pango_layout_set_spacing(layout, config->spacing * PANGO_SCALE);
 
-	pango_layout_set_text(layout, text, -1);
+	pango_layout_set_text(layout, text, (int)len);
 
 	PangoRectangle ink_rect, logical_rect;
 	pango_layout_get_extents(layout, &ink_rect, &logical_rect);
@@ -389,102 +394,416 @@ static inline bool is_printable(const char *t)
 	return false;
 }
 
-void tp_edit_text(struct tp_source *src, char * text)
+static pthread_mutex_t mirrors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void set_text(struct tp_source *src, struct text_snapshot *text)
 {
+	text_snapshot_addref(text);
+
 	pthread_mutex_lock(&src->config_mutex);
-	BFREE_IF_NONNULL(src->config.text);
-	src->config.text = bstrdup(text);
+	struct text_snapshot *old = src->config.text;
+	src->config.text = text;
 	src->config_updated = 1;
 	pthread_mutex_unlock(&src->config_mutex);
-}
 
+	text_snapshot_release(old);
+	tp_queue_render(src);
+}
 
-static void *tp_thread_main(void *data)
+void tp_edit_text(struct tp_source *src, struct text_snapshot *text)
 {
-	struct tp_source *src = data;
+	set_text(src, text);
 
-	struct stat st_prev = {0};
-	struct tp_config config_prev = {0};
-	bool b_printable_prev = false;
+	// unlocked peek, tp_set_mirror sends the current text when attaching
+	if (!src->num_mirrors)
+		return;
 
-	setpriority(PRIO_PROCESS, 0, 19);
-	os_set_thread_name("text-pthread");
+	// the snapshot is shared, each mirror renders it in its own style
+	pthread_mutex_lock(&mirrors_mutex);
+	for (size_t i = 0; i < src->num_mirrors; i++)
+		set_text(src->mirrors[i], text);
+	pthread_mutex_unlock(&mirrors_mutex);
+}
 
-	while (src->running) {
-		os_sleep_ms(33);
+static void detach_mirror(struct tp_source *mirror)
+{
+	struct tp_source *src = mirror->mirroring;
+	if (!src)
+		return;
+
+	for (size_t i = 0; i < src->num_mirrors; i++) {
+		if (src->mirrors[i] == mirror) {
+			memmove(&src->mirrors[i], &src->mirrors[i + 1], (src->num_mirrors - i - 1) * sizeof(*src->mirrors));
+			src->num_mirrors--;
+			break;
+		}
+	}
+	mirror->mirroring = NULL;
+}
+
+void tp_set_mirror(struct tp_source *mirror, struct tp_source *src)
+{
+	pthread_mutex_lock(&mirrors_mutex);
+	detach_mirror(mirror);
 
+	if (src) {
+		src->mirrors = brealloc(src->mirrors, (src->num_mirrors + 1) * sizeof(*src->mirrors));
+		src->mirrors[src->num_mirrors++] = mirror;
+		mirror->mirroring = src;
+
+		// start from what the source shows now
 		pthread_mutex_lock(&src->config_mutex);
+		struct text_snapshot *text = text_snapshot_addref(src->config.text);
+		pthread_mutex_unlock(&src->config_mutex);
+		if (text) {
+			set_text(mirror, text);
+			text_snapshot_release(text);
+		}
+	}
+	pthread_mutex_unlock(&mirrors_mutex);
+}
+
+bool tp_is_mirroring(struct tp_source *mirror)
+{
+	pthread_mutex_lock(&mirrors_mutex);
+	bool mirroring = mirror->mirroring != NULL;
+	pthread_mutex_unlock(&mirrors_mutex);
+	return mirroring;
+}
+
+void tp_clear_mirrors(struct tp_source *src)
+{
+	pthread_mutex_lock(&mirrors_mutex);
+	detach_mirror(src);
+	for (size_t i = 0; i < src->num_mirrors; i++)
+		src->mirrors[i]->mirroring = NULL;
+	bfree(src->mirrors);
+	src->mirrors = NULL;
+	src->num_mirrors = 0;
+	pthread_mutex_unlock(&mirrors_mutex);
+}
+
+// Render jobs of every source run on a few shared workers instead of a
+// thread per source. A source has at most one job waiting, which draws the
+// newest config when it starts, so updates arriving meanwhile cost nothing.
+
+#define TP_POOL_MAX_WORKERS 4
+// how long a job may wait for a worker, earliest deadline runs first
+#define TP_LIVE_DEADLINE_NS 33000000ULL
+#define TP_PREVIEW_DEADLINE_NS 100000000ULL
+
+static struct {
+	pthread_mutex_t mutex;
+	// signalled when a job is queued or the workers should stop
+	pthread_cond_t queued;
+	// signalled when a job finishes
+	pthread_cond_t done;
+	struct tp_source *jobs;
+	bool stopping;
+
+	pthread_t workers[TP_POOL_MAX_WORKERS];
+	int num_workers;
+	size_t num_sources;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+// serializes starting and stopping the workers, never taken by them
+static pthread_mutex_t pool_sources_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t job_deadline(struct tp_source *src)
+{
+	return src->job_request_ns + (os_atomic_load_bool(&src->live) ? TP_LIVE_DEADLINE_NS : TP_PREVIEW_DEADLINE_NS);
+}
+
+// called with the pool's lock held
+static void enqueue_job(struct tp_source *src)
+{
+	src->job_deadline_ns = job_deadline(src);
+	src->job_next = pool.jobs;
+	pool.jobs = src;
+	src->job_queued = true;
+	pthread_cond_signal(&pool.queued);
+}
 
-		bool config_updated = src->config_updated;
-		bool text_updated = false;
-
-		// check config and copy
-		if (config_updated) {
-			if (config_prev.text && src->config.text &&
-			    strcmp(config_prev.text, src->config.text))
-				text_updated = true;
-
-			BFREE_IF_NONNULL(config_prev.font_name);
-			BFREE_IF_NONNULL(config_prev.font_style);
-			BFREE_IF_NONNULL(config_prev.text);
-			memcpy(&config_prev, &src->config, sizeof(struct tp_config));
-			config_prev.font_name = bstrdup(src->config.font_name);
-			config_prev.font_style = bstrdup(src->config.font_style);
-			config_prev.text = bstrdup(src->config.text);
-			src->config_updated = 0;
+// called with the pool's lock held
+static void dequeue_job(struct tp_source *src)
+{
+	for (struct tp_source **p = &pool.jobs; *p; p = &(*p)->job_next) {
+		if (*p == src) {
+			*p = src->job_next;
+			break;
 		}
+	}
+	src->job_next = NULL;
+	src->job_queued = false;
+}
 
-		pthread_mutex_unlock(&src->config_mutex);
+// called with the pool's lock held
+static struct tp_source *pop_next_job(void)
+{
+	struct tp_source *next = NULL;
+	for (struct tp_source *src = pool.jobs; src; src = src->job_next) {
+		if (!next || src->job_deadline_ns < next->job_deadline_ns)
+			next = src;
+	}
+	if (next)
+		dequeue_job(next);
+	return next;
+}
 
-		// TODO: how long will it take to draw a new texture?
-		// If it takes much longer than frame rate, it should notify the main thread to start fade-out.
+static void tp_render_job(struct tp_source *src)
+{
+	struct tp_config *drawn = &src->drawn;
 
-		// load file if changed and draw
-		if (config_updated || text_updated) {
-			uint64_t time_ns = os_gettime_ns();
-			char *text = config_prev.text;
-			bool b_printable = text ? is_printable(text) : 0;
+	pthread_mutex_lock(&src->config_mutex);
 
-			// make an early notification
-			if (b_printable) {
-				os_atomic_set_bool(&src->text_updating, true);
-			}
+	bool config_updated = src->config_updated;
+	bool text_updated = false;
 
-			struct tp_texture *tex;
-			if (b_printable) {
-				tex = tp_draw_texture(&config_prev, text);
-			}
-			else {
-				tex = bzalloc(sizeof(struct tp_texture));
-			}
-			tex->time_ns = time_ns;
-			tex->config_updated = config_updated && !text_updated;
+	// check config and copy
+	if (config_updated) {
+		if (drawn->text && src->config.text && !text_snapshot_equal(drawn->text, src->config.text))
+			text_updated = true;
+
+		tp_config_destroy_member(drawn);
+		memcpy(drawn, &src->config, sizeof(struct tp_config));
+		drawn->font_name = bstrdup(src->config.font_name);
+		drawn->font_style = bstrdup(src->config.font_style);
+		drawn->text = text_snapshot_addref(src->config.text);
+		src->config_updated = 0;
+	}
+
+	pthread_mutex_unlock(&src->config_mutex);
+
+	if (!config_updated)
+		return;
+
+	uint64_t time_ns = os_gettime_ns();
+	struct text_snapshot *text = drawn->text;
+	bool b_printable = text ? is_printable(text->text) : 0;
+
+	// make an early notification
+	if (b_printable) {
+		os_atomic_set_bool(&src->text_updating, true);
+	}
+
+	struct tp_texture *tex;
+	if (b_printable) {
+		tex = tp_draw_texture(drawn, text->text, text->len);
+	}
+	else {
+		tex = bzalloc(sizeof(struct tp_texture));
+	}
+	tex->time_ns = time_ns;
+	tex->config_updated = !text_updated;
+
+	pthread_mutex_lock(&src->tex_mutex);
+	src->tex_new = pushback_texture(src->tex_new, tex);
+	tex = NULL;
+	pthread_mutex_unlock(&src->tex_mutex);
+
+	blog(LOG_DEBUG, "[catpion] tp_draw_texture & tp_draw_texture takes %f ms\n", (os_gettime_ns() - time_ns) * 1e-6);
+}
+
+// called with the pool's lock held
+static uint64_t job_start(struct tp_source *src)
+{
+	uint64_t start_ns = os_gettime_ns();
+	uint64_t queue_ns = start_ns - src->job_request_ns;
+	src->stats.jobs++;
+	src->stats.queue_ns_total += queue_ns;
+	if (src->stats.queue_ns_max < queue_ns)
+		src->stats.queue_ns_max = queue_ns;
+	if (start_ns > src->job_deadline_ns)
+		src->stats.late_jobs++;
+	src->job_running = true;
+	return start_ns;
+}
 
-			pthread_mutex_lock(&src->tex_mutex);
-			src->tex_new = pushback_texture(src->tex_new, tex);
-			tex = NULL;
-			pthread_mutex_unlock(&src->tex_mutex);
+// called with the pool's lock held
+static void job_finish(struct tp_source *src, uint64_t start_ns)
+{
+	src->stats.render_ns_total += os_gettime_ns() - start_ns;
+	src->job_running = false;
+	pthread_cond_broadcast(&pool.done);
+}
 
-			blog(LOG_DEBUG, "[catpion] tp_draw_texture & tp_draw_texture takes %f ms\n", (os_gettime_ns() - time_ns) * 1e-6);
+static void *tp_worker_main(void *data)
+{
+	UNUSED_PARAMETER(data);
 
-			if (text_updated)
-				b_printable_prev = b_printable;
+	setpriority(PRIO_PROCESS, 0, 19);
+	os_set_thread_name("text-pthread");
 
+	pthread_mutex_lock(&pool.mutex);
+	while (!pool.stopping) {
+		struct tp_source *src = pop_next_job();
+		if (!src) {
+			pthread_cond_wait(&pool.queued, &pool.mutex);
+			continue;
 		}
+
+		uint64_t start_ns = job_start(src);
+		pthread_mutex_unlock(&pool.mutex);
+
+		tp_render_job(src);
+
+		pthread_mutex_lock(&pool.mutex);
+		job_finish(src, start_ns);
+		// changed again while drawing
+		if (src->job_again && src->running && !os_atomic_load_bool(&src->parked))
+			enqueue_job(src);
+		src->job_again = false;
 	}
+	pthread_mutex_unlock(&pool.mutex);
 
-	tp_config_destroy_member(&config_prev);
 	return NULL;
 }
 
+static void pool_start(void)
+{
+	int cores = os_get_logical_cores();
+	// leave the other cores to the recognizers and OBS
+	int n = cores / 2;
+	if (n < 1)
+		n = 1;
+	if (n > TP_POOL_MAX_WORKERS)
+		n = TP_POOL_MAX_WORKERS;
+
+	pool.stopping = false;
+	for (pool.num_workers = 0; pool.num_workers < n; pool.num_workers++) {
+		if (pthread_create(&pool.workers[pool.num_workers], NULL, tp_worker_main, NULL) != 0)
+			break;
+	}
+	if (pool.num_workers)
+		blog(LOG_INFO, "[catpion] Text rendering on %d shared threads", pool.num_workers);
+	else
+		blog(LOG_ERROR, "[catpion] Can't start text rendering threads, drawing text on the callers' threads");
+}
+
+static void pool_stop(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+	pool.stopping = true;
+	pthread_cond_broadcast(&pool.queued);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (int i = 0; i < pool.num_workers; i++)
+		pthread_join(pool.workers[i], NULL);
+	pool.num_workers = 0;
+}
+
+// Without workers the thread changing the config draws it, one at a time
+// per source, picking up what changed meanwhile
+static void render_inline(struct tp_source *src)
+{
+	do {
+		src->job_again = false;
+		src->job_deadline_ns = job_deadline(src);
+		uint64_t start_ns = job_start(src);
+		pthread_mutex_unlock(&pool.mutex);
+
+		tp_render_job(src);
+
+		pthread_mutex_lock(&pool.mutex);
+		job_finish(src, start_ns);
+	} while (src->job_again && src->running && !os_atomic_load_bool(&src->parked));
+	src->job_again = false;
+}
+
+void tp_queue_render(struct tp_source *src)
+{
+	pthread_mutex_lock(&pool.mutex);
+	if (src->running && !os_atomic_load_bool(&src->parked)) {
+		src->stats.requests++;
+		if (src->job_running) {
+			if (!src->job_again)
+				src->job_request_ns = os_gettime_ns();
+			src->job_again = true;
+		}
+		else if (!pool.num_workers) {
+			src->job_request_ns = os_gettime_ns();
+			render_inline(src);
+		}
+		else if (!src->job_queued) {
+			src->job_request_ns = os_gettime_ns();
+			enqueue_job(src);
+		}
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
 void tp_thread_start(struct tp_source *src)
 {
+	pthread_mutex_lock(&pool_sources_mutex);
+	if (pool.num_sources++ == 0)
+		pool_start();
+	pthread_mutex_unlock(&pool_sources_mutex);
+
+	pthread_mutex_lock(&pool.mutex);
 	src->running = true;
-	pthread_create(&src->thread, NULL, tp_thread_main, src);
+	pthread_mutex_unlock(&pool.mutex);
+
+	tp_queue_render(src);
 }
 
 void tp_thread_end(struct tp_source *src)
 {
+	pthread_mutex_lock(&pool.mutex);
 	src->running = false;
-	pthread_join(src->thread, NULL);
+	if (src->job_queued)
+		dequeue_job(src);
+	while (src->job_running)
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+
+	tp_config_destroy_member(&src->drawn);
+
+	pthread_mutex_lock(&pool_sources_mutex);
+	if (--pool.num_sources == 0)
+		pool_stop();
+	pthread_mutex_unlock(&pool_sources_mutex);
+}
+
+void tp_thread_park(struct tp_source *src, bool park)
+{
+	pthread_mutex_lock(&src->config_mutex);
+	os_atomic_set_bool(&src->parked, park);
+	// draw whatever changed while parked
+	if (!park)
+		src->config_updated = true;
+	pthread_mutex_unlock(&src->config_mutex);
+
+	if (park) {
+		pthread_mutex_lock(&pool.mutex);
+		if (src->job_queued)
+			dequeue_job(src);
+		src->job_again = false;
+		pthread_mutex_unlock(&pool.mutex);
+	}
+	else {
+		tp_queue_render(src);
+	}
+}
+
+void tp_thread_set_live(struct tp_source *src, bool live)
+{
+	pthread_mutex_lock(&pool.mutex);
+	os_atomic_set_bool(&src->live, live);
+	// move a waiting job to its new deadline
+	if (src->job_queued) {
+		dequeue_job(src);
+		enqueue_job(src);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+void tp_get_render_stats(struct tp_source *src, struct tp_render_stats *stats)
+{
+	pthread_mutex_lock(&pool.mutex);
+	*stats = src->stats;
+	pthread_mutex_unlock(&pool.mutex);
 }
@@ -2,6 +2,9 @@
 #define OBS_TEXT_PTHREAD_H
 
 #include <pthread.h>
+#include <util/threading.h>
+
+#include "text-snapshot.h"
 
 struct tp_texture
 {
@@ -36,7 +39,7 @@ struct tp_config
 	uint32_t font_size;
 	uint32_t font_flags;
 	// TODO: font weight stretch gravity
-	char *text;
+	struct text_snapshot *text;
 	uint32_t color;
 	uint32_t width, height;
 	bool shrink_size;
@@ -55,6 +58,19 @@ struct tp_config
 	bool shadow;
 	uint32_t shadow_color;
 	int32_t shadow_x, shadow_y;
+	// text lines are already broken to fit the width
+	bool prewrapped;
+};
+
+struct tp_render_stats
+{
+	uint64_t requests;
+	// requests folded into a job still waiting are not counted again
+	uint64_t jobs;
+	uint64_t late_jobs;
+	uint64_t queue_ns_total;
+	uint64_t queue_ns_max;
+	uint64_t render_ns_total;
 };
 
 struct tp_source
@@ -77,12 +93,36 @@ struct tp_source
 	// internal use for main
 	struct tp_texture *textures;
 
-	// threads
-	pthread_t thread;
+	// render jobs on the shared worker pool
+	// guarded by the pool's lock
+	// a parked source is not queued until it is unparked
+	volatile bool parked;
+	// on the program output, rendered ahead of preview-only sources
+	volatile bool live;
+	struct tp_source *job_next;
+	bool job_queued;
+	bool job_running;
+	bool job_again;
+	uint64_t job_request_ns;
+	uint64_t job_deadline_ns;
+	struct tp_render_stats stats;
+	// the config last drawn, only touched by the running job
+	struct tp_config drawn;
+
+	// mirrors showing this source's text, and the source this one mirrors
+	// guarded by a lock shared by all sources
+	struct tp_source **mirrors;
+	size_t num_mirrors;
+	struct tp_source *mirroring;
 };
 
 void tp_thread_start(struct tp_source *src);
 void tp_thread_end(struct tp_source *src);
+void tp_thread_park(struct tp_source *src, bool park);
+void tp_thread_set_live(struct tp_source *src, bool live);
+/* redraw after the config changed, jobs already waiting take the newest config */
+void tp_queue_render(struct tp_source *src);
+void tp_get_render_stats(struct tp_source *src, struct tp_render_stats *stats);
 
 #define BFREE_IF_NONNULL(x) \
 	if (x) {            \
@@ -94,7 +134,8 @@ static inline void tp_config_destroy_member(struct tp_config *c)
 {
 	BFREE_IF_NONNULL(c->font_name);
 	BFREE_IF_NONNULL(c->font_style);
-	BFREE_IF_NONNULL(c->text);
+	text_snapshot_release(c->text);
+	c->text = NULL;
 }
 
 static inline void free_texture(struct tp_texture *t)
@@ -135,6 +176,13 @@ static inline struct tp_texture *popfront_texture(struct tp_texture *t)
 	return ret;
 }
 
-void tp_edit_text(struct tp_source *src, char * text);
+/* takes a new reference to text, shared with the mirrors */
+void tp_edit_text(struct tp_source *src, struct text_snapshot *text);
+
+/* show the text of src in mirror from now on, NULL stops mirroring */
+void tp_set_mirror(struct tp_source *mirror, struct tp_source *src);
+bool tp_is_mirroring(struct tp_source *mirror);
+/* detach the mirrors of a source going away */
+void tp_clear_mirrors(struct tp_source *src);
 
 #endif // OBS_TEXT_PTHREAD_H
@@ -0,0 +1,339 @@
+/* osc-control.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "osc-control.h"
+
+#include <obs-module.h>
+#include <util/threading.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "catpion.h"
+#include "tinyosc.h"
+
+#define OSC_CONTROL_MAX 2048
+
+static void osc_control_reply_stats(struct osc_control *ctl, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct obs_audio_caption_src *acs = ctl->acs;
+	struct caption_fanout_stats fstats;
+	caption_fanout_get_stats(&acs->fanout, &fstats);
+
+	struct caption_sink_stats sinks[CAPTION_SINK_COUNT];
+	pthread_mutex_lock(&acs->lg_mutex);
+	line_generator_get_sink_stats(&acs->lg, sinks);
+	pthread_mutex_unlock(&acs->lg_mutex);
+
+	char buffer[OSC_CONTROL_MAX];
+	int len = tosc_writeMessage(buffer, sizeof(buffer), "/catpion/stats", "siiiiiiiiii",
+				    obs_source_get_name(acs->source),
+				    (int)os_atomic_load_bool(&acs->paused),
+				    acs->session != NULL ? (int)acs->model_id : -1,
+				    (int)fstats.num_dests,
+				    (int)fstats.sent,
+				    (int)fstats.dropped,
+				    (int)fstats.errors,
+				    (int)sinks[CAPTION_SINK_SCREEN].suppressed,
+				    (int)sinks[CAPTION_SINK_OUTPUTS].suppressed,
+				    (int)sinks[CAPTION_SINK_OSC].suppressed,
+				    (int)sinks[CAPTION_SINK_SHM].suppressed);
+	if (len > 0) {
+		sendto(ctl->fd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL, addr, addr_len);
+	}
+}
+
+static void osc_control_reply_history(struct osc_control *ctl, tosc_message *msg, const struct sockaddr *addr,
+				      socklen_t addr_len)
+{
+	struct obs_audio_caption_src *acs = ctl->acs;
+	int wanted = strcmp(tosc_getFormat(msg), "i") == 0 ? tosc_getNextInt32(msg) : -1;
+
+	char line[AC_LINE_MAX + 1];
+	char buffer[AC_LINE_MAX + 64];
+
+	/* One message per line, oldest first, read straight out of the history
+	 * arena. The sends don't block so holding the lock is fine */
+	pthread_mutex_lock(&acs->lg_mutex);
+	size_t count = line_generator_history_count(&acs->lg);
+	size_t first = (wanted >= 0 && (size_t)wanted < count) ? count - (size_t)wanted : 0;
+	for (size_t i = first; i < count; i++) {
+		size_t len;
+		const char *text = line_generator_history_line(&acs->lg, i, &len);
+		if (len > AC_LINE_MAX)
+			len = AC_LINE_MAX;
+		memcpy(line, text, len);
+		line[len] = '\0';
+
+		int olen = tosc_writeMessage(buffer, sizeof(buffer), "/catpion/history", "iis", (int)(i - first),
+					     (int)(count - first), line);
+		if (olen > 0) {
+			sendto(ctl->fd, buffer, olen, MSG_DONTWAIT | MSG_NOSIGNAL, addr, addr_len);
+		}
+	}
+	pthread_mutex_unlock(&acs->lg_mutex);
+}
+
+static bool osc_control_is_loopback(const struct sockaddr *addr)
+{
+	if (addr->sa_family != AF_INET) {
+		return false;
+	}
+	const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+	return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+}
+
+static void osc_control_dispatch(struct osc_control *ctl, tosc_message *msg, const struct sockaddr *addr,
+				 socklen_t addr_len)
+{
+	struct obs_audio_caption_src *acs = ctl->acs;
+	const char *address = tosc_getAddress(msg);
+
+	if (strcmp(address, "/catpion/break") == 0) {
+		pthread_mutex_lock(&acs->lg_mutex);
+		if (acs->session != NULL) {
+			line_generator_break(&acs->lg);
+			line_generator_set_text(&acs->lg);
+		}
+		pthread_mutex_unlock(&acs->lg_mutex);
+	} else if (strcmp(address, "/catpion/clear") == 0) {
+		pthread_mutex_lock(&acs->lg_mutex);
+		if (acs->session != NULL) {
+			line_generator_clear(&acs->lg);
+			line_generator_set_text(&acs->lg);
+		}
+		pthread_mutex_unlock(&acs->lg_mutex);
+	} else if (strcmp(address, "/catpion/pause") == 0) {
+		os_atomic_set_bool(&acs->paused, true);
+		blog(LOG_INFO, "[catpion] %s: recognition paused", obs_source_get_name(acs->source));
+	} else if (strcmp(address, "/catpion/resume") == 0) {
+		os_atomic_set_bool(&acs->paused, false);
+		blog(LOG_INFO, "[catpion] %s: recognition resumed", obs_source_get_name(acs->source));
+	} else if (strcmp(address, "/catpion/model") == 0) {
+		/* loading a model reads any path on this machine, keep that local
+		 * even when other hosts may control the source */
+		if (!osc_control_is_loopback(addr)) {
+			blog(LOG_WARNING, "[catpion] Ignored /catpion/model from a remote host");
+			return;
+		}
+		const char *path = strcmp(tosc_getFormat(msg), "s") == 0 ? tosc_getNextString(msg) : NULL;
+		if (path && *path) {
+			CatpionLoadModel(path);
+		}
+	} else if (strcmp(address, "/catpion/stats") == 0) {
+		osc_control_reply_stats(ctl, addr, addr_len);
+	} else if (strcmp(address, "/catpion/history") == 0) {
+		osc_control_reply_history(ctl, msg, addr, addr_len);
+	} else {
+		blog(LOG_DEBUG, "[catpion] Unknown OSC command %s", address);
+	}
+}
+
+/* Size of a NUL terminated OSC string padded to 4 bytes, 0 if it runs past end */
+static size_t osc_string_size(const char *p, const char *end)
+{
+	const char *nul = memchr(p, '\0', end - p);
+	if (!nul) {
+		return 0;
+	}
+	size_t size = ((nul - p) + 4) & ~(size_t)3;
+	return size <= (size_t)(end - p) ? size : 0;
+}
+
+/* tinyosc doesn't bound check the address, format or arguments, do it here
+ * so the tosc_getNext* calls in dispatch stay inside the packet */
+static bool osc_control_parse(tosc_message *msg, char *buffer, int len)
+{
+	if (len < 8 || (len & 3) != 0) {
+		return false;
+	}
+
+	const char *end = buffer + len;
+	size_t size = osc_string_size(buffer, end);
+	if (size == 0 || size >= (size_t)len || buffer[size] != ',') {
+		return false;
+	}
+	const char *format = buffer + size;
+	size = osc_string_size(format, end);
+	if (size == 0) {
+		return false;
+	}
+
+	const char *arg = format + size;
+	for (const char *f = format + 1; *f; f++) {
+		size_t remaining = end - arg;
+		switch (*f) {
+		case 'i':
+		case 'f':
+		case 'm':
+			size = 4;
+			break;
+		case 'd':
+		case 'h':
+		case 't':
+			size = 8;
+			break;
+		case 's':
+			size = osc_string_size(arg, end);
+			if (size == 0) {
+				return false;
+			}
+			break;
+		case 'b':
+			if (remaining < 4) {
+				return false;
+			}
+			size = 4 + ((ntohl(*(const uint32_t *)arg) + (size_t)3) & ~(size_t)3);
+			break;
+		case 'T':
+		case 'F':
+		case 'N':
+		case 'I':
+			size = 0;
+			break;
+		default:
+			return false;
+		}
+		if (size > remaining) {
+			return false;
+		}
+		arg += size;
+	}
+
+	return tosc_parseMessage(msg, buffer, len) == 0;
+}
+
+static void on_osc_control_cb(void *data, int fd, uint32_t mask)
+{
+	struct osc_control *ctl = data;
+	char buffer[OSC_CONTROL_MAX];
+
+	if (mask & (SPA_IO_ERR | SPA_IO_HUP)) {
+		blog(LOG_WARNING, "[catpion] OSC control socket error");
+		return;
+	}
+
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		ssize_t len = recvfrom(fd, buffer, sizeof(buffer), MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *)&addr,
+				       &addr_len);
+		if (len <= 0) {
+			break;
+		}
+		/* MSG_TRUNC reports the real datagram size, drop what didn't fit */
+		if (len > (ssize_t)sizeof(buffer)) {
+			blog(LOG_DEBUG, "[catpion] Dropped oversized OSC control packet (%zd bytes)", len);
+			continue;
+		}
+
+		tosc_message msg;
+		if (len >= 16 && tosc_isBundle(buffer)) {
+			/* walk the bundle elements checking their sizes */
+			char *p = buffer + 16;
+			char *end = buffer + len;
+			while (p + 4 <= end) {
+				uint32_t elen = ntohl(*(uint32_t *)p);
+				p += 4;
+				if (elen > (uint32_t)(end - p)) {
+					break;
+				}
+				if (osc_control_parse(&msg, p, elen)) {
+					osc_control_dispatch(ctl, &msg, (struct sockaddr *)&addr, addr_len);
+				}
+				p += elen;
+			}
+		} else if (osc_control_parse(&msg, buffer, len)) {
+			osc_control_dispatch(ctl, &msg, (struct sockaddr *)&addr, addr_len);
+		}
+	}
+}
+
+void osc_control_init(struct osc_control *ctl, struct obs_audio_caption_src *acs)
+{
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->fd = -1;
+	ctl->acs = acs;
+}
+
+void osc_control_stop(struct osc_control *ctl)
+{
+	if (ctl->source) {
+		pw_loop_destroy_source(pw_thread_loop_get_loop(ctl->acs->pw.thread_loop), ctl->source);
+		ctl->source = NULL;
+	}
+	if (ctl->fd >= 0) {
+		close(ctl->fd);
+		ctl->fd = -1;
+		blog(LOG_INFO, "[catpion] Stopped OSC control on port %d", ctl->port);
+	}
+	ctl->port = 0;
+}
+
+void osc_control_set_port(struct osc_control *ctl, int port, bool any_host)
+{
+	if (port == ctl->port && any_host == ctl->any_host) {
+		return;
+	}
+
+	pw_thread_loop_lock(ctl->acs->pw.thread_loop);
+
+	osc_control_stop(ctl);
+	ctl->any_host = any_host;
+
+	if (port <= 0) {
+		goto unlock;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (fd < 0) {
+		blog(LOG_WARNING, "[catpion] Can't open OSC control socket");
+		goto unlock;
+	}
+
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(any_host ? INADDR_ANY : INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		blog(LOG_WARNING, "[catpion] Can't bind OSC control to port %d: %s", port, strerror(errno));
+		close(fd);
+		goto unlock;
+	}
+
+	ctl->source = pw_loop_add_io(pw_thread_loop_get_loop(ctl->acs->pw.thread_loop), fd, SPA_IO_IN, false,
+				     on_osc_control_cb, ctl);
+	if (!ctl->source) {
+		blog(LOG_WARNING, "[catpion] Can't add OSC control to the PipeWire loop");
+		close(fd);
+		goto unlock;
+	}
+
+	ctl->fd = fd;
+	ctl->port = port;
+	blog(LOG_INFO, "[catpion] Listening for OSC control on port %d", port);
+
+unlock:
+	pw_thread_loop_unlock(ctl->acs->pw.thread_loop);
+}
@@ -0,0 +1,64 @@
+/* osc-control.h
+ * OSC command listener to drive a caption source remotely
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <pipewire/pipewire.h>
+
+struct obs_audio_caption_src;
+
+/**
+ * UDP socket polled by the source's PipeWire loop. Accepted messages:
+ *   /catpion/break         force a line break
+ *   /catpion/clear         clear all lines
+ *   /catpion/pause         stop feeding audio to the recognizer
+ *   /catpion/resume        resume feeding audio
+ *   /catpion/model s       load the model at the given path, loopback senders only
+ *   /catpion/stats         reply to the sender with /catpion/stats: source name,
+ *                          paused, model id, caption destinations, packets sent,
+ *                          dropped and failed, then identical updates suppressed
+ *                          for the screen, caption outputs, OSC and shared memory
+ *   /catpion/history [i]   reply to the sender with the last i (default all) lines
+ *                          of the caption history, oldest first, one
+ *                          /catpion/history message each: index, count, text
+ */
+struct osc_control {
+	int fd;
+	int port;
+	bool any_host;
+	struct spa_source *source;
+
+	struct obs_audio_caption_src *acs;
+};
+
+void osc_control_init(struct osc_control *ctl, struct obs_audio_caption_src *acs);
+
+/**
+ * (Re)bind the listener, port 0 disables it
+ * @warning Call with the thread loop unlocked
+ */
+void osc_control_set_port(struct osc_control *ctl, int port, bool any_host);
+
+/**
+ * @warning Call with the thread loop locked
+ */
+void osc_control_stop(struct osc_control *ctl);
@@ -23,6 +23,7 @@
 
 #include <obs-module.h>
 #include <util/platform.h>
+#include <util/threading.h>
 
 #include <spa/utils/json.h>
 
@@ -56,37 +57,219 @@ bool json_object_find(const char *obj, const char *key, char *value, size_t len)
 /* ------------------------------------------------- */
 
 /* PipeWire stream wrapper */
-static void on_process_cb(void *data)
+static void flush_sessions(struct obs_audio_caption_src *acs)
+{
+	if (acs->session) {
+		aas_flush(acs->session);
+	}
+	channel_split_flush(&acs->split);
+}
+
+/* The recognizer takes mono, average the channels */
+static void feed_downmix(struct obs_pw_audio_stream *s, const short *samples, uint32_t frames, uint32_t channels)
+{
+	if (channels <= 1) {
+		aas_feed_pcm16(s->acs->session, (short *)samples, frames);
+		return;
+	}
+
+	while (frames > 0) {
+		uint32_t chunk = frames < OBS_PW_AUDIO_MIX_FRAMES ? frames : OBS_PW_AUDIO_MIX_FRAMES;
+		for (uint32_t f = 0; f < chunk; f++) {
+			int32_t sum = 0;
+			for (uint32_t c = 0; c < channels; c++) {
+				sum += samples[c];
+			}
+			s->mix[f] = (short)(sum / (int32_t)channels);
+			samples += channels;
+		}
+		aas_feed_pcm16(s->acs->session, s->mix, chunk);
+		frames -= chunk;
+	}
+}
+
+/* Callback jitter is smoothed like RFC 3550's interarrival jitter */
+static void update_timing(struct obs_pw_audio_stream *s, uint32_t n_frames)
 {
 	uint64_t now = os_gettime_ns();
+	uint64_t quantum = n_frames;
+	uint32_t rate = s->format.info.raw.rate;
+
+	struct spa_io_position *position = s->position;
+	if (position && position->clock.rate.denom) {
+		quantum = position->clock.duration;
+		rate = position->clock.rate.denom;
+	}
+	if (!quantum || !rate) {
+		return;
+	}
+
+	if (s->last_process_ns) {
+		int64_t expected = (int64_t)(quantum * 1000000000ULL / rate);
+		int64_t deviation = (int64_t)(now - s->last_process_ns) - expected;
+		if (deviation < 0) {
+			deviation = -deviation;
+		}
+		/* longer gaps are pauses, not jitter */
+		if (deviation < 4 * expected) {
+			s->jitter_ns += (deviation - s->jitter_ns) / 16;
+		}
+	}
+	s->last_process_ns = now;
+
+	os_atomic_set_long(&s->quantum, (long)quantum);
+	os_atomic_set_long(&s->quantum_rate, (long)rate);
+	os_atomic_set_long(&s->jitter_us, (long)(s->jitter_ns / 1000));
+}
+
+void obs_pw_audio_stream_get_timing(struct obs_pw_audio_stream *s, struct obs_pw_audio_timing *timing)
+{
+	timing->quantum = (uint32_t)os_atomic_load_long(&s->quantum);
+	timing->rate = (uint32_t)os_atomic_load_long(&s->quantum_rate);
+	timing->jitter_ms = (double)os_atomic_load_long(&s->jitter_us) / 1000.0;
+	timing->filled_frames = (uint64_t)os_atomic_load_long(&s->filled_frames);
+	timing->dropped_frames = (uint64_t)os_atomic_load_long(&s->dropped_frames);
+	timing->gap_flushes = (uint64_t)os_atomic_load_long(&s->gap_flushes);
+}
+
+static void feed_audio(struct obs_pw_audio_stream *s, const short *samples, uint32_t n_frames, uint32_t n_channels)
+{
+	/* the mix is emptied while channels are split, so only one of the two is ever set up */
+	if (s->mix_index || s->acs->mix.num_inputs) {
+		input_mix_push(&s->acs->mix, s->mix_index, samples, n_frames, n_channels, s->acs->session);
+	} else if (s->acs->split.num_channels) {
+		channel_split_feed(&s->acs->split, samples, n_frames, n_channels);
+	} else if (s->acs->session) {
+		feed_downmix(s, samples, n_frames, n_channels);
+	}
+}
+
+static void feed_silence(struct obs_pw_audio_stream *s, uint64_t n_frames, uint32_t n_channels)
+{
+	static const short silence[OBS_PW_AUDIO_MIX_FRAMES];
+	uint32_t chunk = OBS_PW_AUDIO_MIX_FRAMES / n_channels;
 
+	while (n_frames > 0) {
+		uint32_t n = n_frames < chunk ? (uint32_t)n_frames : chunk;
+		feed_audio(s, silence, n, n_channels);
+		n_frames -= n;
+	}
+}
+
+/* Only the main stream ends sentences, mixed inputs leave gaps to the mixer */
+static void gap_flush(struct obs_pw_audio_stream *s)
+{
+	if (s->mix_index == 0) {
+		flush_sessions(s->acs);
+	}
+	s->gap_flushed = true;
+}
+
+/* A cycle without audio, e.g. a graph xrun */
+static void on_miss(struct obs_pw_audio_stream *s)
+{
+	uint64_t now = os_gettime_ns();
+
+	if (!s->miss_start_ns) {
+		s->miss_start_ns = now;
+	} else if (!s->gap_flushed && now - s->miss_start_ns >= OBS_PW_AUDIO_GAP_FLUSH_NS) {
+		gap_flush(s);
+		os_atomic_set_long(&s->gap_flushes, ++s->gap_flush_count);
+	}
+}
+
+/**
+ * Measure the audio missing since the last buffer from the graph clock.
+ * Short gaps are filled with silence so words aren't cut, long ones end
+ * the sentence once.
+ */
+static void on_audio(struct obs_pw_audio_stream *s, uint32_t n_channels, bool paused)
+{
+	uint64_t now = os_gettime_ns();
+	uint64_t gap_ns = 0;
+
+	struct spa_io_position *position = s->position;
+	if (position && position->clock.rate.denom) {
+		uint64_t pos = position->clock.position;
+		if (s->expected_position && pos > s->expected_position) {
+			gap_ns = (pos - s->expected_position) * 1000000000ULL / position->clock.rate.denom;
+		}
+		s->expected_position = pos + position->clock.duration;
+	} else if (s->miss_start_ns) {
+		gap_ns = now - s->miss_start_ns;
+	}
+
+	uint32_t rate = s->format.info.raw.rate;
+	uint64_t gap_frames = gap_ns * rate / 1000000000ULL;
+	bool missed = s->miss_start_ns != 0;
+	bool flushed = s->gap_flushed;
+	s->miss_start_ns = 0;
+	s->gap_flushed = false;
+
+	if (!gap_frames) {
+		return;
+	}
+
+	if (gap_ns <= OBS_PW_AUDIO_GAP_FILL_NS && !flushed) {
+		if (!paused) {
+			feed_silence(s, gap_frames, n_channels);
+		}
+		s->filled_count += gap_frames;
+		os_atomic_set_long(&s->filled_frames, (long)s->filled_count);
+		return;
+	}
+
+	if (!flushed) {
+		gap_flush(s);
+	}
+	/* a stream that wasn't running, e.g. while idle, lost nothing */
+	if (missed || gap_ns < OBS_PW_AUDIO_GAP_FLUSH_NS) {
+		s->dropped_count += gap_frames;
+		os_atomic_set_long(&s->dropped_frames, (long)s->dropped_count);
+		if (!flushed) {
+			os_atomic_set_long(&s->gap_flushes, ++s->gap_flush_count);
+		}
+	}
+}
+
+static void on_process_cb(void *data)
+{
 	struct obs_pw_audio_stream *s = data;
 
 	struct pw_buffer *b = pw_stream_dequeue_buffer(s->stream);
 
 	if (!b) {
-		if(s->acs->session) {
-	        aas_flush(s->acs->session);
-		}
+		on_miss(s);
 		return;
 	}
 
 	struct spa_buffer *buf = b->buffer;
 
-    if (buf->datas[0].data == NULL){
-		if(s->acs->session) {
-	        aas_flush(s->acs->session);
-		}
+	uint32_t n_channels = s->format.info.raw.channels ? s->format.info.raw.channels : 1;
+	uint32_t n_frames = buf->datas[0].chunk->size / sizeof(short) / n_channels;
+	if (buf->datas[0].data == NULL || n_frames == 0) {
+		on_miss(s);
 		goto queue;
-    }
+	}
+
+	update_timing(s, n_frames);
+	if (!s->first_audio_ns) {
+		os_atomic_set_long(&s->first_audio_ns, (long)os_gettime_ns());
+	}
 
-	if(s->acs->session) {
-	    uint32_t n_channels, n_samples;
+	bool paused = os_atomic_load_bool(&s->acs->paused);
+	if (s->mix_index == 0 && paused != s->acs->was_paused) {
+		/* finish the current sentence when pausing */
+		if (paused) {
+			flush_sessions(s->acs);
+		}
+		s->acs->was_paused = paused;
+	}
 
-		n_channels = s->format.info.raw.channels;
-		n_samples = buf->datas[0].chunk->size / sizeof(short);
+	on_audio(s, n_channels, paused);
 
-		aas_feed_pcm16(s->acs->session, (short *)buf->datas[0].data, n_samples);
+	if (!paused) {
+		feed_audio(s, (const short *)buf->datas[0].data, n_frames, n_channels);
 	}
 
 queue:
@@ -123,16 +306,75 @@ static void on_param_changed_cb(void *data, uint32_t id, const struct spa_pod *p
 		s->format.info.raw.rate, s->format.info.raw.channels);
 }
 
+static void on_io_changed_cb(void *data, uint32_t id, void *area, uint32_t size)
+{
+	UNUSED_PARAMETER(size);
+
+	struct obs_pw_audio_stream *s = data;
+
+	if (id == SPA_IO_Position) {
+		s->position = area;
+	}
+}
+
 static const struct pw_stream_events stream_events = {
 	PW_VERSION_STREAM_EVENTS,
 	.process = on_process_cb,
+	.io_changed = on_io_changed_cb,
 	.state_changed = on_state_changed_cb,
 	.param_changed = on_param_changed_cb,
 };
 
+bool obs_pw_audio_stream_init(struct obs_pw_audio_stream *s, struct pw_core *core, bool capture_sink,
+							  bool want_driver, struct obs_audio_caption_src *acs)
+{
+	s->acs = acs;
+	s->stream =
+		pw_stream_new(
+			core, "OBS",
+			pw_properties_new(
+				PW_KEY_NODE_NAME, "OBS", 
+				PW_KEY_NODE_DESCRIPTION, "OBS Audio Capture",
+				PW_KEY_MEDIA_TYPE, "Audio", 
+				PW_KEY_MEDIA_CATEGORY, "Capture", 
+				PW_KEY_MEDIA_ROLE, "Production", 
+				PW_KEY_NODE_WANT_DRIVER, want_driver ? "true" : "false",
+				PW_KEY_STREAM_CAPTURE_SINK, capture_sink ? "true" : "false", 
+				NULL));
+
+	if (!s->stream) {
+		blog(LOG_WARNING, "[catpion] Failed to create stream");
+		return false;
+	}
+	blog(LOG_INFO, "[catpion] Created stream %p", s->stream);
+
+	pw_stream_add_listener(s->stream, &s->stream_listener, &stream_events, s);
+
+	return true;
+}
+
+void obs_pw_audio_stream_destroy(struct obs_pw_audio_stream *s)
+{
+	if (!s->stream) {
+		return;
+	}
+
+	if (s->filled_frames || s->dropped_frames) {
+		blog(LOG_INFO, "[catpion] Stream %p: %ld frames of short gaps filled with silence, %ld frames lost in %ld long gaps",
+		     s->stream, s->filled_frames, s->dropped_frames, s->gap_flushes);
+	}
+
+	spa_hook_remove(&s->stream_listener);
+	if (pw_stream_get_state(s->stream, NULL) != PW_STREAM_STATE_UNCONNECTED) {
+		pw_stream_disconnect(s->stream);
+	}
+	pw_stream_destroy(s->stream);
+	s->stream = NULL;
+}
+
 int obs_pw_audio_stream_connect(
 	struct obs_pw_audio_stream *s, uint32_t target_serial, uint32_t audio_channels, 
-	uint32_t model_sample_rate)
+	uint32_t model_sample_rate, uint32_t latency_ms)
 {
 	uint8_t buffer[2048];
 	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
@@ -147,9 +389,22 @@ int obs_pw_audio_stream_connect(
 
 	struct pw_properties *stream_props = pw_properties_new(NULL, NULL);
 	pw_properties_setf(stream_props, PW_KEY_TARGET_OBJECT, "%u", target_serial);
+	if (latency_ms) {
+		pw_properties_setf(stream_props, PW_KEY_NODE_LATENCY, "%u/1000", latency_ms);
+	}
 	pw_stream_update_properties(s->stream, &stream_props->dict);
 	pw_properties_free(stream_props);
 
+	/* timing starts over with the new node */
+	s->last_process_ns = 0;
+	s->jitter_ns = 0;
+	s->expected_position = 0;
+	s->miss_start_ns = 0;
+	s->gap_flushed = false;
+	os_atomic_set_long(&s->first_audio_ns, 0);
+	os_atomic_set_long(&s->quantum, 0);
+	os_atomic_set_long(&s->jitter_us, 0);
+
 	return pw_stream_connect(
 		s->stream, 
 		PW_DIRECTION_INPUT, 
@@ -168,6 +423,11 @@ static void on_core_done_cb(void *data, uint32_t id, int seq)
 	struct obs_pw_audio_instance *pw = data;
 
 	if (id == PW_ID_CORE && pw->seq == seq) {
+		if (pw->sync_start_ns) {
+			blog(LOG_INFO, "[catpion] PipeWire registry synced in %.1f ms",
+				 (os_gettime_ns() - pw->sync_start_ns) / 1000000.0);
+			pw->sync_start_ns = 0;
+		}
 		pw_thread_loop_signal(pw->thread_loop, false);
 	}
 }
@@ -215,40 +475,12 @@ bool obs_pw_audio_instance_init(struct obs_pw_audio_instance *pw, const struct p
 	}
 	pw_registry_add_listener(pw->registry, &pw->registry_listener, registry_events, registry_cb_data);
 
-	pw->audio.acs = acs;
-	pw->audio.stream =
-		pw_stream_new(
-			pw->core, "OBS",
-			pw_properties_new(
-				PW_KEY_NODE_NAME, "OBS", 
-				PW_KEY_NODE_DESCRIPTION, "OBS Audio Capture",
-				PW_KEY_MEDIA_TYPE, "Audio", 
-				PW_KEY_MEDIA_CATEGORY, "Capture", 
-				PW_KEY_MEDIA_ROLE, "Production", 
-				PW_KEY_NODE_WANT_DRIVER, stream_want_driver ? "true" : "false",
-				PW_KEY_STREAM_CAPTURE_SINK, stream_capture_sink ? "true" : "false", 
-				NULL));
-
-	if (!pw->audio.stream) {
-		blog(LOG_WARNING, "[catpion] Failed to create stream");
-		return false;
-	}
-	blog(LOG_INFO, "[catpion] Created stream %p", pw->audio.stream);
-
-	pw_stream_add_listener(pw->audio.stream, &pw->audio.stream_listener, &stream_events, &pw->audio);
-
-	return true;
+	return obs_pw_audio_stream_init(&pw->audio, pw->core, stream_capture_sink, stream_want_driver, acs);
 }
 
 void obs_pw_audio_instance_destroy(struct obs_pw_audio_instance *pw)
 {
-	if (pw->audio.stream) {
-		spa_hook_remove(&pw->audio.stream_listener);
-		if (pw_stream_get_state(pw->audio.stream, NULL) != PW_STREAM_STATE_UNCONNECTED) {
-			pw_stream_disconnect(pw->audio.stream);
-		}
-		pw_stream_destroy(pw->audio.stream);
-	}
+	obs_pw_audio_stream_destroy(&pw->audio);
 
 	if (pw->registry) {
 		spa_hook_remove(&pw->registry_listener);
@@ -274,6 +506,7 @@ void obs_pw_audio_instance_destroy(struct obs_pw_audio_instance *pw)
 
 void obs_pw_audio_instance_sync(struct obs_pw_audio_instance *pw)
 {
+	pw->sync_start_ns = os_gettime_ns();
 	pw->seq = pw_core_sync(pw->core, PW_ID_CORE, pw->seq);
 }
 /* ------------------------------------------------- */
@@ -25,9 +25,17 @@
 #include <pipewire/pipewire.h>
 #include <pipewire/extensions/metadata.h>
 #include <spa/param/audio/format-utils.h>
+#include <spa/node/io.h>
 
 /* PipeWire Stream wrapper */
 
+/* Frames downmixed at a time */
+#define OBS_PW_AUDIO_MIX_FRAMES 2048
+/* Shorter gaps in the audio are filled with silence */
+#define OBS_PW_AUDIO_GAP_FILL_NS (200 * 1000000ULL)
+/* Audio missing for this long ends the current sentence */
+#define OBS_PW_AUDIO_GAP_FLUSH_NS (500 * 1000000ULL)
+
 /**
  * PipeWire stream wrapper that outputs to an OBS source
  */
@@ -37,15 +45,77 @@ struct obs_pw_audio_stream {
     struct spa_audio_info format;
 
     struct obs_audio_caption_src *acs;
+	/* input of acs->mix this stream feeds, 0 is the main stream */
+	size_t mix_index;
+
+	/* mono mix of multi-channel audio, process callback only */
+	short mix[OBS_PW_AUDIO_MIX_FRAMES];
+
+	/* graph clock, from io_changed */
+	struct spa_io_position *position;
+	/* callback timing, written by the process callback */
+	uint64_t last_process_ns;
+	int64_t jitter_ns;
+	volatile long quantum;
+	volatile long quantum_rate;
+	volatile long jitter_us;
+	/* when the first buffer since connecting arrived */
+	volatile long first_audio_ns;
+
+	/* gap tracking, process callback only */
+	uint64_t expected_position;
+	uint64_t miss_start_ns;
+	bool gap_flushed;
+	uint64_t filled_count;
+	uint64_t dropped_count;
+	uint64_t gap_flush_count;
+	/* published copies of the counts */
+	volatile long filled_frames;
+	volatile long dropped_frames;
+	volatile long gap_flushes;
+};
+
+/**
+ * How often the graph wakes a stream up
+ */
+struct obs_pw_audio_timing {
+	/* frames per cycle at rate, 0 before the first cycle */
+	uint32_t quantum;
+	uint32_t rate;
+	/* moving average of how far cycles are from their expected period */
+	double jitter_ms;
+	/* frames of short gaps fed as silence */
+	uint64_t filled_frames;
+	/* frames missing in gaps long enough to end the sentence */
+	uint64_t dropped_frames;
+	uint64_t gap_flushes;
 };
 
+void obs_pw_audio_stream_get_timing(struct obs_pw_audio_stream *s, struct obs_pw_audio_timing *timing);
+
+/**
+ * Create a stream for acs, not connected to any node yet
+ * @warning Call with the thread loop locked
+ * @return true on success, false on error
+ */
+bool obs_pw_audio_stream_init(
+	struct obs_pw_audio_stream *s, struct pw_core *core, bool capture_sink,
+	bool want_driver, struct obs_audio_caption_src *acs);
+
+/**
+ * Disconnect and destroy a stream
+ * @warning Call with the thread loop locked
+ */
+void obs_pw_audio_stream_destroy(struct obs_pw_audio_stream *s);
+
 /**
  * Connect a stream with the default params
+ * @param latency_ms Requested node latency, 0 leaves it to the graph
  * @return 0 on success, < 0 on error
  */
 int obs_pw_audio_stream_connect(
 	struct obs_pw_audio_stream *s, uint32_t target_serial, uint32_t channels, 
-	uint32_t model_sample_rate);
+	uint32_t model_sample_rate, uint32_t latency_ms);
 /* ------------------------------------------------- */
 
 /**
@@ -58,6 +128,8 @@ struct obs_pw_audio_instance {
 	struct pw_core *core;
 	struct spa_hook core_listener;
 	int seq;
+	/* when the pending sync was started, for the startup log */
+	uint64_t sync_start_ns;
 
 	struct pw_registry *registry;
 	struct spa_hook registry_listener;
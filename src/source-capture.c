@@ -0,0 +1,186 @@
+/* source-capture.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "source-capture.h"
+
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <string.h>
+
+#include "catpion.h"
+
+/* A missing target is looked up again this often */
+#define SOURCE_CAPTURE_LOOKUP_NS 2000000000ULL
+
+static void source_capture_cb(void *param, obs_source_t *source, const struct audio_data *audio, bool muted)
+{
+	UNUSED_PARAMETER(source);
+
+	struct source_capture *sc = param;
+	struct obs_audio_caption_src *acs = sc->acs;
+
+	pthread_mutex_lock(&sc->feed_mutex);
+
+	bool paused = os_atomic_load_bool(&acs->paused) || muted;
+	if (paused != sc->was_paused) {
+		/* finish the current sentence when pausing or muting */
+		if (paused && sc->session) {
+			aas_flush(sc->session);
+		}
+		sc->was_paused = paused;
+	}
+
+	if (!sc->session || paused || !sc->sample_rate) {
+		goto unlock;
+	}
+
+	if (!sc->resampler || sc->resampler_rate != sc->sample_rate) {
+		const struct audio_output_info *obs_info = audio_output_get_info(obs_get_audio());
+		struct resample_info src = {
+			.samples_per_sec = obs_info->samples_per_sec,
+			.format = AUDIO_FORMAT_FLOAT_PLANAR,
+			.speakers = obs_info->speakers,
+		};
+		struct resample_info dst = {
+			.samples_per_sec = (uint32_t)sc->sample_rate,
+			.format = AUDIO_FORMAT_16BIT,
+			.speakers = SPEAKERS_MONO,
+		};
+
+		audio_resampler_destroy(sc->resampler);
+		sc->resampler = audio_resampler_create(&dst, &src);
+		sc->resampler_rate = (uint32_t)sc->sample_rate;
+		if (!sc->resampler) {
+			blog(LOG_WARNING, "[catpion] Can't convert %u Hz audio to %u Hz", src.samples_per_sec,
+			     dst.samples_per_sec);
+			goto unlock;
+		}
+	}
+
+	uint8_t *out[MAX_AV_PLANES] = {0};
+	uint32_t out_frames = 0;
+	uint64_t ts_offset = 0;
+	if (audio_resampler_resample(sc->resampler, out, &out_frames, &ts_offset, (const uint8_t *const *)audio->data,
+				     audio->frames) &&
+	    out_frames) {
+		aas_feed_pcm16(sc->session, (short *)out[0], out_frames);
+	}
+
+unlock:
+	pthread_mutex_unlock(&sc->feed_mutex);
+}
+
+static void source_capture_detach(struct source_capture *sc)
+{
+	obs_source_t *source = obs_weak_source_get_source(sc->target);
+	if (source) {
+		obs_source_remove_audio_capture_callback(source, source_capture_cb, sc);
+		obs_source_release(source);
+	}
+	obs_weak_source_release(sc->target);
+	sc->target = NULL;
+}
+
+/* Called with the mutex held */
+static void source_capture_attach(struct source_capture *sc)
+{
+	obs_source_t *source = obs_get_source_by_name(sc->name);
+	if (!source) {
+		sc->next_lookup_ns = os_gettime_ns() + SOURCE_CAPTURE_LOOKUP_NS;
+		return;
+	}
+
+	if (obs_source_get_output_flags(source) & OBS_SOURCE_AUDIO) {
+		sc->target = obs_source_get_weak_source(source);
+		obs_source_add_audio_capture_callback(source, source_capture_cb, sc);
+		blog(LOG_INFO, "[catpion] %s: captioning audio from %s", obs_source_get_name(sc->acs->source), sc->name);
+	} else {
+		blog(LOG_WARNING, "[catpion] %s has no audio to caption", sc->name);
+		sc->next_lookup_ns = UINT64_MAX;
+	}
+	obs_source_release(source);
+}
+
+void source_capture_init(struct source_capture *sc, struct obs_audio_caption_src *acs)
+{
+	memset(sc, 0, sizeof(*sc));
+	pthread_mutex_init(&sc->mutex, NULL);
+	pthread_mutex_init(&sc->feed_mutex, NULL);
+	sc->acs = acs;
+}
+
+void source_capture_destroy(struct source_capture *sc)
+{
+	source_capture_set_target(sc, NULL);
+	audio_resampler_destroy(sc->resampler);
+	pthread_mutex_destroy(&sc->feed_mutex);
+	pthread_mutex_destroy(&sc->mutex);
+}
+
+bool source_capture_set_target(struct source_capture *sc, const char *name)
+{
+	if (name && !*name)
+		name = NULL;
+
+	pthread_mutex_lock(&sc->mutex);
+	if ((!name && !sc->name) || (name && sc->name && strcmp(name, sc->name) == 0)) {
+		pthread_mutex_unlock(&sc->mutex);
+		return name != NULL;
+	}
+
+	source_capture_detach(sc);
+	bfree(sc->name);
+	sc->name = name ? bstrdup(name) : NULL;
+	if (sc->name)
+		source_capture_attach(sc);
+	pthread_mutex_unlock(&sc->mutex);
+
+	return name != NULL;
+}
+
+void source_capture_set_session(struct source_capture *sc, AprilASRSession session, size_t sample_rate)
+{
+	pthread_mutex_lock(&sc->feed_mutex);
+	sc->session = session;
+	sc->sample_rate = sample_rate;
+	pthread_mutex_unlock(&sc->feed_mutex);
+}
+
+void source_capture_tick(struct source_capture *sc)
+{
+	if (pthread_mutex_trylock(&sc->mutex) != 0)
+		return;
+
+	if (sc->target) {
+		obs_source_t *source = obs_weak_source_get_source(sc->target);
+		if (source) {
+			obs_source_release(source);
+		} else {
+			/* removed, a new source may take its name */
+			source_capture_detach(sc);
+		}
+	} else if (sc->name && os_gettime_ns() >= sc->next_lookup_ns) {
+		source_capture_attach(sc);
+	}
+
+	pthread_mutex_unlock(&sc->mutex);
+}
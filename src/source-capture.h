@@ -0,0 +1,86 @@
+/* source-capture.h
+ * Feed the recognizer from the audio of another OBS source
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <obs.h>
+#include <media-io/audio-resampler.h>
+#include <april_api.h>
+
+struct obs_audio_caption_src;
+
+/**
+ * Audio capture callback on an OBS source, so captions follow the
+ * filtered signal viewers hear instead of opening the device again.
+ * The planar float mix is downmixed and resampled to the model's rate
+ * on the OBS audio thread and fed to the caption source's session.
+ */
+struct source_capture {
+	pthread_mutex_t mutex;
+
+	/* guarded by mutex */
+	char *name;
+	obs_weak_source_t *target;
+	uint64_t next_lookup_ns;
+
+	/* Copy of the caption source's session, held by the audio thread while
+	 * feeding so it isn't released under it. Kept apart from the PipeWire
+	 * loop lock, which the loop thread may hold for a while */
+	pthread_mutex_t feed_mutex;
+	AprilASRSession session;
+	size_t sample_rate;
+	bool was_paused;
+
+	/* audio thread only */
+	audio_resampler_t *resampler;
+	uint32_t resampler_rate;
+
+	struct obs_audio_caption_src *acs;
+};
+
+void source_capture_init(struct source_capture *sc, struct obs_audio_caption_src *acs);
+void source_capture_destroy(struct source_capture *sc);
+
+/**
+ * Capture the source with this name, NULL or empty stops capturing
+ * @return true if a source is to be captured, even if it doesn't exist yet
+ */
+bool source_capture_set_target(struct source_capture *sc, const char *name);
+
+/**
+ * Feed captured audio to this session, at the model's sample rate.
+ * The old session may be released once this returns.
+ */
+void source_capture_set_session(struct source_capture *sc, AprilASRSession session, size_t sample_rate);
+
+/**
+ * Attach to the target if it showed up, or detach if it went away
+ */
+void source_capture_tick(struct source_capture *sc);
+
+static inline bool source_capture_active(struct source_capture *sc)
+{
+	return sc->name != NULL;
+}
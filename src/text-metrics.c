@@ -0,0 +1,191 @@
+/* text-metrics.c
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "text-metrics.h"
+
+#include <obs-module.h>
+#include <pango/pangocairo.h>
+#include <pthread.h>
+#include <string.h>
+
+#define ASCII_ADVANCES 128
+
+struct text_font_cache {
+	struct text_font_cache *next;
+	long refs;
+
+	char *font_name;
+	uint32_t font_size;
+	uint32_t font_flags;
+
+	/* Pango objects aren't thread safe, each cache owns its font map and
+	 * only measures with the mutex held */
+	pthread_mutex_t mutex;
+	PangoFontMap *font_map;
+	PangoContext *context;
+	PangoLayout *layout;
+
+	/* advances in pango units, -1 until measured */
+	int32_t ascii[ASCII_ADVANCES];
+	/* gunichar -> advance + 1 */
+	GHashTable *advances;
+};
+
+static pthread_mutex_t caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct text_font_cache *caches = NULL;
+
+static struct text_font_cache *text_font_cache_create(const char *font_name, uint32_t font_size, uint32_t font_flags)
+{
+	struct text_font_cache *cache = bzalloc(sizeof(struct text_font_cache));
+	cache->refs = 1;
+	cache->font_name = bstrdup(font_name);
+	cache->font_size = font_size;
+	cache->font_flags = font_flags;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	cache->font_map = pango_cairo_font_map_new();
+	cache->context = pango_font_map_create_context(cache->font_map);
+	cache->layout = pango_layout_new(cache->context);
+
+	/* Same description tp_draw_texture uses */
+	PangoFontDescription *desc = pango_font_description_new();
+	pango_font_description_set_family(desc, font_name);
+	pango_font_description_set_weight(desc, (font_flags & OBS_FONT_BOLD) ? PANGO_WEIGHT_BOLD : 0);
+	pango_font_description_set_style(desc, (font_flags & OBS_FONT_ITALIC) ? PANGO_STYLE_ITALIC : 0);
+	pango_font_description_set_size(desc, (font_size * PANGO_SCALE * 2) / 3);
+	pango_layout_set_font_description(cache->layout, desc);
+	pango_font_description_free(desc);
+
+	for (int i = 0; i < ASCII_ADVANCES; i++)
+		cache->ascii[i] = -1;
+	cache->advances = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+
+	blog(LOG_DEBUG, "[catpion] Created glyph cache for %s %u", font_name, font_size);
+	return cache;
+}
+
+static void text_font_cache_free(struct text_font_cache *cache)
+{
+	g_hash_table_destroy(cache->advances);
+	g_object_unref(cache->layout);
+	g_object_unref(cache->context);
+	g_object_unref(cache->font_map);
+	pthread_mutex_destroy(&cache->mutex);
+	bfree(cache->font_name);
+	bfree(cache);
+}
+
+struct text_font_cache *text_font_cache_get(const char *font_name, uint32_t font_size, uint32_t font_flags)
+{
+	if (!font_name || !*font_name || !font_size)
+		return NULL;
+
+	pthread_mutex_lock(&caches_mutex);
+
+	struct text_font_cache *cache;
+	for (cache = caches; cache; cache = cache->next) {
+		if (cache->font_size == font_size && cache->font_flags == font_flags &&
+		    strcmp(cache->font_name, font_name) == 0) {
+			cache->refs++;
+			break;
+		}
+	}
+
+	if (!cache) {
+		cache = text_font_cache_create(font_name, font_size, font_flags);
+		cache->next = caches;
+		caches = cache;
+	}
+
+	pthread_mutex_unlock(&caches_mutex);
+	return cache;
+}
+
+void text_font_cache_release(struct text_font_cache *cache)
+{
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&caches_mutex);
+	bool last = --cache->refs == 0;
+	if (last) {
+		for (struct text_font_cache **p = &caches; *p; p = &(*p)->next) {
+			if (*p == cache) {
+				*p = cache->next;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&caches_mutex);
+
+	if (last)
+		text_font_cache_free(cache);
+}
+
+static int32_t measure_advance(struct text_font_cache *cache, gunichar c)
+{
+	char buf[8];
+	int len = g_unichar_to_utf8(c, buf);
+	int width = 0;
+
+	pango_layout_set_text(cache->layout, buf, len);
+	pango_layout_get_size(cache->layout, &width, NULL);
+	return width;
+}
+
+uint32_t text_font_cache_width(struct text_font_cache *cache, const char *text)
+{
+	int64_t width = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for (const char *p = text; *p;) {
+		unsigned char b = (unsigned char)*p;
+		if (b < ASCII_ADVANCES) {
+			if (b >= 0x20) {
+				if (cache->ascii[b] < 0)
+					cache->ascii[b] = measure_advance(cache, b);
+				width += cache->ascii[b];
+			}
+			p++;
+			continue;
+		}
+
+		gunichar c = g_utf8_get_char_validated(p, -1);
+		if (c == (gunichar)-1 || c == (gunichar)-2)
+			break;
+
+		gpointer found = g_hash_table_lookup(cache->advances, GUINT_TO_POINTER(c));
+		int32_t advance;
+		if (found) {
+			advance = GPOINTER_TO_INT(found) - 1;
+		} else {
+			advance = measure_advance(cache, c);
+			g_hash_table_insert(cache->advances, GUINT_TO_POINTER(c), GINT_TO_POINTER(advance + 1));
+		}
+		width += advance;
+
+		p = g_utf8_next_char(p);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return (uint32_t)((width + PANGO_SCALE - 1) / PANGO_SCALE);
+}
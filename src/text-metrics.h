@@ -0,0 +1,39 @@
+/* text-metrics.h
+ * Glyph advance cache used to break caption lines in pixels
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct text_font_cache;
+
+/**
+ * Get the cache for a font as tp_draw_texture lays it out, sources using
+ * the same font share one cache. Returns NULL if there is no font name.
+ */
+struct text_font_cache *text_font_cache_get(const char *font_name, uint32_t font_size, uint32_t font_flags);
+void text_font_cache_release(struct text_font_cache *cache);
+
+/**
+ * Width of an UTF-8 string in pixels, as the sum of its glyph advances.
+ * Kerning and shaping are not accounted for, callers should leave a margin.
+ */
+uint32_t text_font_cache_width(struct text_font_cache *cache, const char *text);
@@ -0,0 +1,109 @@
+/* text-snapshot.h
+ * Length tracked text views and refcounted immutable text snapshots
+ *
+ * Copyright (C) 2023 by Grillo del Mal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <util/bmem.h>
+#include <util/threading.h>
+
+struct text_view {
+	const char *text;
+	size_t len;
+};
+
+static inline struct text_view text_view_from_str(const char *text)
+{
+	struct text_view v = {text, text ? strlen(text) : 0};
+	return v;
+}
+
+/**
+ * Text shared between threads without copying. The text is only written
+ * while the writer holds the sole reference, after that it is immutable.
+ */
+struct text_snapshot {
+	volatile long refs;
+	size_t len;
+	size_t cap;
+	char text[];
+};
+
+static inline struct text_snapshot *text_snapshot_alloc(size_t cap)
+{
+	struct text_snapshot *s = bmalloc(sizeof(struct text_snapshot) + cap);
+	s->refs = 1;
+	s->len = 0;
+	s->cap = cap;
+	s->text[0] = '\0';
+	return s;
+}
+
+static inline struct text_snapshot *text_snapshot_create(const char *text)
+{
+	size_t len = strlen(text);
+	struct text_snapshot *s = text_snapshot_alloc(len + 1);
+	memcpy(s->text, text, len + 1);
+	s->len = len;
+	return s;
+}
+
+static inline struct text_snapshot *text_snapshot_addref(struct text_snapshot *s)
+{
+	if (s)
+		os_atomic_inc_long(&s->refs);
+	return s;
+}
+
+static inline void text_snapshot_release(struct text_snapshot *s)
+{
+	if (s && os_atomic_dec_long(&s->refs) == 0)
+		bfree(s);
+}
+
+/* true if the caller holds the only reference and may write to it */
+static inline bool text_snapshot_exclusive(struct text_snapshot *s)
+{
+	return os_atomic_load_long(&s->refs) == 1;
+}
+
+static inline bool text_snapshot_equal(const struct text_snapshot *a, const struct text_snapshot *b)
+{
+	if (a == b)
+		return true;
+	if (!a || !b)
+		return false;
+	return a->len == b->len && memcmp(a->text, b->text, a->len) == 0;
+}
+
+/* FNV-1a, to tell whether text changed since it was last delivered */
+#define TEXT_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t text_hash_update(uint64_t h, const char *text, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)text[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}